@@ -0,0 +1,45 @@
+﻿#include <array>
+#include <benchmark/benchmark.h>
+#include <cryptopp/osrng.h>
+
+#include "util/util.h"
+#include "util/key_config.h"
+
+namespace
+{
+	// Size of a session key, what ElGamal wraps for a peer
+	constexpr usize PLAIN_SIZE = 32;
+
+	/**
+	 * \brief sequential messages to one peer, building the encryptor from the public key on every message like before User kept one
+	 */
+	void encryptor_per_message(benchmark::State& state_, ar::KeyConfig config_)
+	{
+		cry::AutoSeededRandomPool rng{};
+		const auto [private_key, public_key] = ar::generate_keys(rng, config_);
+		const std::array<u8, PLAIN_SIZE> plain{};
+		for (auto _ : state_)
+		{
+			const cry::ElGamal::Encryptor encryptor{ public_key };
+			benchmark::DoNotOptimize(ar::encrypt(rng, encryptor, std::span<const u8>{ plain }));
+		}
+	}
+
+	/**
+	 * \brief sequential messages to one peer with the precomputed encryptor User keeps
+	 */
+	void cached_encryptor(benchmark::State& state_, ar::KeyConfig config_)
+	{
+		cry::AutoSeededRandomPool rng{};
+		const auto [private_key, public_key] = ar::generate_keys(rng, config_);
+		const auto encryptor = ar::make_encryptor(public_key);
+		const std::array<u8, PLAIN_SIZE> plain{};
+		for (auto _ : state_)
+			benchmark::DoNotOptimize(ar::encrypt(rng, encryptor, std::span<const u8>{ plain }));
+	}
+}
+
+BENCHMARK_CAPTURE(encryptor_per_message, fixed_2048, ar::KeyConfig{ 2048, ar::KeyGroup::Fixed })->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(cached_encryptor, fixed_2048, ar::KeyConfig{ 2048, ar::KeyGroup::Fixed })->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(encryptor_per_message, fixed_3072, ar::KeyConfig{ 3072, ar::KeyGroup::Fixed })->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(cached_encryptor, fixed_3072, ar::KeyConfig{ 3072, ar::KeyGroup::Fixed })->Unit(benchmark::kMicrosecond);
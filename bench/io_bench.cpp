@@ -0,0 +1,260 @@
+﻿#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "server.h"
+
+namespace
+{
+	// Next to the ones of the server executable and login_bench
+	constexpr u16 SERVER_PORT = 9698;
+
+#ifdef AR_HAS_IO_URING
+	constexpr std::string_view BACKEND = "io_uring";
+#else
+	constexpr std::string_view BACKEND = "epoll";
+#endif
+
+	/**
+	 * \brief syscalls entered by every thread of the process, counted by the raw_syscalls:sys_enter tracepoint.
+	 * Should be opened before any thread starts, only threads created afterwards inherit it. Needs tracefs and perf_event_paranoid <= 1 (or CAP_PERFMON)
+	 */
+	class SyscallCounter
+	{
+	public:
+		SyscallCounter() noexcept
+		{
+			std::FILE* file = nullptr;
+			for (const auto path : { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id", "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" })
+			{
+				if ((file = std::fopen(path, "r")))
+					break;
+			}
+			unsigned long long tracepoint{};
+			const auto found = file && std::fscanf(file, "%llu", &tracepoint) == 1;
+			if (file)
+				std::fclose(file);
+			if (!found)
+			{
+				spdlog::warn("raw_syscalls tracepoint not found, syscalls aren't counted");
+				return;
+			}
+
+			perf_event_attr attr{};
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_TRACEPOINT;
+			attr.config = tracepoint;
+			attr.inherit = 1;
+			m_fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+			if (m_fd < 0)
+				spdlog::warn("perf_event_open failed, syscalls aren't counted: {}", std::error_code{errno, std::system_category()}.message());
+		}
+
+		~SyscallCounter() noexcept
+		{
+			if (m_fd >= 0)
+				::close(m_fd);
+		}
+
+		// Sum of this thread and every thread inherited the counter so far
+		[[nodiscard]] std::optional<u64> read() const noexcept
+		{
+			u64 count{};
+			if (m_fd < 0 || ::read(m_fd, &count, sizeof(count)) != sizeof(count))
+				return std::nullopt;
+			return count;
+		}
+
+	private:
+		int m_fd{-1};
+	};
+
+	/**
+	 * \brief server side of the benchmark, every message goes straight back to its sender
+	 */
+	class EchoConnections : public ar::IConnectionHandler
+	{
+	public:
+		connection_ptr add_connection(ar::stream_socket&& socket_, ar::ref<ar::IMessageHandler<ar::ConnectionType::Server>> message_handler_, const ar::ConnectionConfig& config_) noexcept override
+		{
+			auto conn = std::make_shared<connection_type>(++m_last_id, std::move(socket_), message_handler_, *this, config_);
+			std::unique_lock lock{ m_mutex };
+			m_connections.push_back(conn);
+			return conn;
+		}
+
+		void remove_connection(connection_type& conn_) noexcept override
+		{
+			std::unique_lock lock{ m_mutex };
+			std::erase_if(m_connections, [&](const connection_ptr& conn2_) { return conn2_.get() == &conn_; });
+		}
+
+		std::vector<connection_ptr> connections() noexcept override
+		{
+			std::unique_lock lock{ m_mutex };
+			return m_connections;
+		}
+
+		connection_ptr connection(u32 id_) noexcept override
+		{
+			std::unique_lock lock{ m_mutex };
+			const auto conn = std::ranges::find_if(m_connections, [&](const connection_ptr& conn2_) { return conn2_->id() == id_; });
+			return conn == m_connections.end() ? nullptr : *conn;
+		}
+
+		void clear_connections() noexcept override
+		{
+			std::unique_lock lock{ m_mutex };
+			m_connections.clear();
+		}
+
+		asio::awaitable<bool> handshake([[maybe_unused]] connection_type& conn_) noexcept override { co_return true; }
+
+	private:
+		std::mutex m_mutex;
+		std::vector<connection_ptr> m_connections;
+		u32 m_last_id{};
+	};
+
+	class EchoServer : public ar::IServer
+	{
+	public:
+		explicit EchoServer(EchoConnections& connections_) : IServer{ { asio::ip::tcp::v4(), SERVER_PORT }, connections_, 1 }
+		{
+		}
+
+		void on_new_in_message(ar::ServerConnection& conn_, const ar::Message& message_) noexcept override
+		{
+			conn_.send(message_);
+		}
+
+		void on_new_out_message([[maybe_unused]] ar::ServerConnection& conn_, [[maybe_unused]] std::span<const u8> message_) noexcept override {}
+	};
+
+	class ReadyValidator : public ar::IConnectionValidator<ar::ConnectionType::Client>
+	{
+	public:
+		asio::awaitable<bool> handshake([[maybe_unused]] ar::ClientConnection& conn_) noexcept override
+		{
+			m_ready.set_value();
+			co_return true;
+		}
+
+		std::future<void> ready() noexcept { return m_ready.get_future(); }
+
+	private:
+		std::promise<void> m_ready;
+	};
+
+	class EchoClient : public ar::IClient
+	{
+	public:
+		explicit EchoClient(ReadyValidator& validator_) : IClient{ asio::ip::address_v4::loopback(), SERVER_PORT, validator_ }
+		{
+		}
+
+		void on_new_in_message([[maybe_unused]] ar::ClientConnection& conn_, [[maybe_unused]] const ar::Message& message_) noexcept override
+		{
+			m_echoes.fetch_add(1);
+			m_echoes.notify_one();
+		}
+
+		// Block until count_ echoes came since the client connected
+		void wait_echoes(u64 count_) noexcept
+		{
+			for (auto echoes = m_echoes.load(); echoes < count_; echoes = m_echoes.load())
+				m_echoes.wait(echoes);
+		}
+
+		[[nodiscard]] u64 echoes() const noexcept { return m_echoes.load(); }
+
+	private:
+		std::atomic<u64> m_echoes{};
+	};
+
+	u64 context_switches() noexcept
+	{
+		rusage usage{};
+		::getrusage(RUSAGE_SELF, &usage);
+		return static_cast<u64>(usage.ru_nvcsw + usage.ru_nivcsw);
+	}
+
+	/**
+	 * \brief burst_ messages of body_size_ bytes sent back to back, then every echo is awaited. A burst of one is the round trip latency.
+	 * Syscalls and context switches of the client, the server and this thread are reported per message
+	 */
+	void echo(benchmark::State& state_, EchoClient& client_, const SyscallCounter& syscalls_, usize body_size_, usize burst_)
+	{
+		const ar::Message message{ ar::MessageType::Chat, std::vector<u8>(body_size_, 'x') };
+		const auto syscalls_before = syscalls_.read();
+		const auto switches_before = context_switches();
+		for (auto _ : state_)
+		{
+			const auto target = client_.echoes() + burst_;
+			for (usize i = 0; i < burst_; ++i)
+				client_.connection().send(message);
+			client_.wait_echoes(target);
+		}
+
+		const auto messages = static_cast<double>(state_.iterations() * burst_);
+		state_.SetItemsProcessed(static_cast<int64_t>(messages));
+		state_.counters["ctx_switches/msg"] = static_cast<double>(context_switches() - switches_before) / messages;
+		if (const auto syscalls_after = syscalls_.read(); syscalls_before && syscalls_after)
+			state_.counters["syscalls/msg"] = static_cast<double>(*syscalls_after - *syscalls_before) / messages;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::AddCustomContext("backend", std::string{ BACKEND });
+
+	spdlog::set_level(spdlog::level::warn);
+	// Before the event loop threads, they inherit it
+	const SyscallCounter syscalls{};
+
+	EchoConnections connections{};
+	EchoServer server{ connections };
+	server.start(true);
+
+	ReadyValidator validator{};
+	auto ready = validator.ready();
+	EchoClient client{ validator };
+	client.connect();
+	if (ready.wait_for(std::chrono::seconds{ 5 }) != std::future_status::ready)
+	{
+		spdlog::error("Echo server can't be reached on port {}", SERVER_PORT);
+		server.stop();
+		return 1;
+	}
+
+	for (const usize body_size : { 64, 4 * 1024 })
+	{
+		for (const usize burst : { 1, 64 })
+		{
+			benchmark::RegisterBenchmark(fmt::format("echo/{}/body:{}/burst:{}", BACKEND, body_size, burst).c_str(),
+				[&, body_size, burst](benchmark::State& state_) { echo(state_, client, syscalls, body_size, burst); })->Unit(benchmark::kMicrosecond)->UseRealTime();
+		}
+	}
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	client.disconnect();
+	server.stop();
+	return 0;
+}
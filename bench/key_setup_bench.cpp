@@ -0,0 +1,25 @@
+﻿#include <benchmark/benchmark.h>
+#include <cryptopp/osrng.h>
+
+#include "util/util.h"
+#include "util/key_config.h"
+
+namespace
+{
+	/**
+	 * \brief key pair as a login presents it: private key, public key and its encoding. Random-512 is what every run did before fixed groups
+	 */
+	void key_setup(benchmark::State& state_, ar::KeyConfig config_)
+	{
+		cry::AutoSeededRandomPool rng{};
+		for (auto _ : state_)
+		{
+			const auto [private_key, public_key] = ar::generate_keys(rng, config_);
+			benchmark::DoNotOptimize(ar::save_public_key(public_key));
+		}
+	}
+}
+
+BENCHMARK_CAPTURE(key_setup, random_512, ar::KeyConfig{ 512, ar::KeyGroup::Random })->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(key_setup, fixed_2048, ar::KeyConfig{ 2048, ar::KeyGroup::Fixed })->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(key_setup, fixed_3072, ar::KeyConfig{ 3072, ar::KeyGroup::Fixed })->Unit(benchmark::kMillisecond);
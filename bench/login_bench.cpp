@@ -0,0 +1,103 @@
+﻿#include <atomic>
+#include <future>
+#include <string>
+#include <benchmark/benchmark.h>
+#include <cryptopp/osrng.h>
+#include <spdlog/spdlog.h>
+
+#include "client.h"
+#include "simple_server.h"
+#include "util/util.h"
+#include "util/key_config.h"
+
+namespace
+{
+	// Port of the in-process server, next to the one of the server executable
+	constexpr u16 SERVER_PORT = 9697;
+	// Same as the one of the server, see ConnectionManager
+	constexpr std::string_view KEY = "n1odah10";
+
+	/**
+	 * \brief pipelined login like SimpleClient does it once the username is known: answer and authentication in one frame, then the feedback
+	 */
+	class LoginValidator : public ar::IConnectionValidator<ar::ConnectionType::Client>
+	{
+	public:
+		LoginValidator(std::string username_, std::vector<u8> public_key_) noexcept
+			: m_username{std::move(username_)}, m_public_key{std::move(public_key_)}
+		{
+		}
+
+		asio::awaitable<bool> handshake(ar::ClientConnection& conn_) noexcept override
+		{
+			ar::Message msg{};
+			if (!co_await conn_.read_message(msg) || msg.type() != ar::MessageType::Validation)
+			{
+				m_logged_in.set_value(false);
+				co_return false;
+			}
+
+			const auto challenge = ar::encrypt_xor(msg.body_as<ar::ValidationMessage>().challenge, KEY);
+			conn_.send(ar::HandshakeMessage{ challenge, ar::AuthenticateMessage{ m_username, m_public_key } });
+
+			const auto result = co_await conn_.read_message(msg) && msg.type() == ar::MessageType::Feedback
+				&& msg.body_as<ar::FeedbackMessage>().data == ar::FeedbackType::AuthenticationSucceed;
+			m_logged_in.set_value(result);
+			co_return result;
+		}
+
+		std::future<bool> logged_in() noexcept { return m_logged_in.get_future(); }
+
+	private:
+		std::string m_username;
+		std::vector<u8> m_public_key;
+		std::promise<bool> m_logged_in;
+	};
+
+	/**
+	 * \brief key pair setup of config_, connect and the whole handshake until the server accepts the login
+	 */
+	void login(benchmark::State& state_, ar::KeyConfig config_)
+	{
+		// Dropped users keep their name for the session grace period, every login takes a new one
+		static std::atomic<u32> s_logins{};
+		cry::AutoSeededRandomPool rng{};
+		for (auto _ : state_)
+		{
+			const auto [private_key, public_key] = ar::generate_keys(rng, config_);
+			LoginValidator validator{ "bench" + std::to_string(++s_logins), ar::save_public_key(public_key) };
+			auto logged_in = validator.logged_in();
+
+			ar::IClient client{ asio::ip::address_v4::loopback(), SERVER_PORT, validator };
+			client.connect();
+			if (!logged_in.get())
+				state_.SkipWithError("Login was rejected");
+
+			state_.PauseTiming();
+			client.disconnect();
+			state_.ResumeTiming();
+		}
+	}
+}
+
+BENCHMARK_CAPTURE(login, random_512, ar::KeyConfig{ 512, ar::KeyGroup::Random })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(login, fixed_2048, ar::KeyConfig{ 2048, ar::KeyGroup::Fixed })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(login, fixed_3072, ar::KeyConfig{ 3072, ar::KeyGroup::Fixed })->Unit(benchmark::kMillisecond)->UseRealTime();
+
+int main(int argc, char** argv)
+{
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+
+	// Every login is logged otherwise
+	spdlog::set_level(spdlog::level::warn);
+	ar::SimpleServer server{ { asio::ip::tcp::v4(), SERVER_PORT } };
+	server.start(true);
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	server.stop();
+	return 0;
+}
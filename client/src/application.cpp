@@ -13,10 +13,14 @@ namespace ar
 	static constexpr std::string_view USER_OFFLINE_PH = "user is offline, come back later"sv;
 	static constexpr std::string_view NOT_SELECTING_PH = "please select person on left side panel"sv;
 	static constexpr std::string_view INPUT_ALLOWED_PH = "write your message here..."sv;
+	// Key pair of this user, kept across runs so logging in doesn't wait for a new one
+	static constexpr std::string_view IDENTITY_PATH = "identity.key"sv;
+	// Login keeps reconnecting in the background after that, the user can just press Authenticate again
+	static constexpr std::chrono::seconds LOGIN_TIMEOUT{ 10 };
 
 	Application::Application()
 		: m_chat_room{std::make_shared<ChatRoom>()}, m_screen{ftxui::ScreenInteractive::Fullscreen()},
-		  m_client{asio::ip::address_v4{{127, 0, 0, 1}}, 9696}
+		  m_client{asio::ip::address_v4{{127, 0, 0, 1}}, 9696, KeyConfig{}, std::filesystem::path{IDENTITY_PATH}}
 	{
 		m_client.set_new_user_callback([this](u32 id_, User& user_) { on_new_user(id_, user_); });
 		m_client.set_disconnect_user_callback([this](u32 id_, User& user_) { on_disconnect_user(id_, user_); });
@@ -27,13 +31,9 @@ namespace ar
 
 	void Application::start()
 	{
-		m_client.connect();
-		
-		if (m_client.wait_for_state(ClientState::Authenticating))
-			render_chat();
-		else
-			spdlog::warn("Failed to connect into server");
-		
+		// Client connects once the username is entered, see render_chat
+		render_chat();
+
 		m_client.disconnect();
 	}
 
@@ -56,8 +56,8 @@ namespace ar
 			send_command_message(CommandType::RequestPublicKey, id, true);
 
 		auto msg = ChatMessage{(!id) ? ChatOpponent::Server : ChatOpponent::User, id, {msg_.begin(), msg_.end()}};
-		msg.encrypt(m_client.rng(), opponent->public_key);
-		m_client.connection().send(msg);
+		msg.encrypt(m_client.rng(), m_client.cipher(), opponent->encryptor);
+		m_client.send(msg);
 	}
 
 	void Application::render_chat() noexcept
@@ -198,6 +198,7 @@ namespace ar
 		});
 
 		bool modal_shown = true;
+		bool connecting = false;
 		std::string username{};
 		Component error_log = std::make_shared<DynamicText>("");
 
@@ -211,27 +212,24 @@ namespace ar
 				Button("Exit", close_fn),
 				Button("Authenticate", [&]
 				{
+					// Username is known before the challenge comes, so the login takes a single round trip and brings the online list along
 					m_client.username(username);
-					if (!m_client.wait_for_state(ClientState::Connected))
+					if (!std::exchange(connecting, true))
+						m_client.connect();
+
+					if (!m_client.wait_for_state(ClientState::Connected, LOGIN_TIMEOUT))
 					{
-						m_screen.Post([&]
+						const auto reason = m_client.state() == ClientState::Closed ? "Connection Rejected! Username already exists"sv : "Server can't be reached, still trying"sv;
+						m_screen.Post([&, reason]
 							{
-								std::dynamic_pointer_cast<DynamicText>(error_log)->text("Connection Rejected! Username already exists");
+								std::dynamic_pointer_cast<DynamicText>(error_log)->text(std::string{ reason });
 								std::this_thread::sleep_for(1s);
 							});
 						return;
 					}
 					std::dynamic_pointer_cast<DynamicText>(username_comp)->text(std::move(username));
 
-					// Get list online
-					send_command_message(CommandType::OnlineList, std::nullopt, true);
-					const auto& users = m_client.users();
-
-					for (const auto& user : users)
-					{
-						add_user(user.first, user.second.name);
-					}
-
+					// Online users are added by the new user callback as the list comes in
 					modal_shown = false;
 				}),
 			}) | align_right,
@@ -253,7 +251,8 @@ namespace ar
 
 		Loop loop{&m_screen, layout};
 
-		while (!loop.HasQuitted() && m_client.connection().is_connected())
+		// Dropped connection is reconnected in the background, only a rejected one ends the chat
+		while (!loop.HasQuitted() && m_client.state() != ClientState::Closed)
 		{
 			loop.RunOnce();
 		}
@@ -281,16 +280,16 @@ namespace ar
 
 	void Application::on_disconnect_user(u32 id_, User& user_) noexcept
 	{
-		usize index = 0;
-		for (; index < m_user_details.size(); ++index)
-		{
-			if (m_user_details[index].first == id_)
-				break;
-		}
-
-		m_screen.Post([this, index]
+		// Looked up on the UI thread, the index of a user shifts once an earlier one is removed
+		m_screen.Post([this, id_]
 			{
-				remove_user(static_cast<u32>(index));
+				for (usize index = 0; index < m_user_details.size(); ++index)
+				{
+					if (m_user_details[index].first != id_)
+						continue;
+					remove_user(static_cast<u32>(index));
+					return;
+				}
 			});
 	}
 
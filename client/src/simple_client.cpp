@@ -9,10 +9,16 @@
 
 namespace ar
 {
-	SimpleClient::SimpleClient(const asio::ip::address& addr_, u16 port_)
-		: IClient{addr_, port_, *this}, m_last_type{MessageType::Undefined}, m_state{ClientState::Undefined},
-		  m_signaler{MessageType::Undefined}
+	SimpleClient::SimpleClient(const asio::ip::address& addr_, u16 port_, const KeyConfig& key_config_, std::filesystem::path identity_path_)
+		: IClient{addr_, port_, *this, ConnectionConfig{ .reconnect_delay = 250ms }}, m_last_type{MessageType::Undefined}, m_state{ClientState::Undefined},
+		  m_signaler{MessageType::Undefined}, m_key_config{key_config_}, m_identity_path{std::move(identity_path_)}
 	{
+		prepare_identity(false);
+	}
+
+	void SimpleClient::rotate_identity() noexcept
+	{
+		prepare_identity(true);
 	}
 
 	bool SimpleClient::wait_for_state(ClientState state_, std::chrono::milliseconds timeout_) const noexcept
@@ -28,11 +34,12 @@ namespace ar
 	{
 		while (m_state != state_ && std::chrono::system_clock::now() < timepoint_)
 		{
-			if (m_state == ClientState::Closed || !connection().is_connected())
+			// Dropped connection is reconnected in the background, only a rejected one never gets there
+			if (m_state == ClientState::Closed)
 				return false;
 			std::this_thread::sleep_for(25ms);
 		}
-		return true;
+		return m_state == state_;
 	}
 
 	void SimpleClient::wait_for_message(MessageType type_, std::chrono::milliseconds timeout_) noexcept
@@ -52,6 +59,50 @@ namespace ar
 		m_last_type = MessageType::Undefined;
 	}
 
+	void SimpleClient::send(const ChatMessage& chat_) noexcept
+	{
+		{
+			std::unique_lock lock{m_outbox_mutex};
+			m_outbox.emplace_back(make_frame(chat_));
+			trim_outbox();
+		}
+		// Only the event loop moves chats onto the connection, so a drop always finds the unsent ones in one place or the other
+		asio::post(m_context, [this] { drain_outbox(); });
+	}
+
+	void SimpleClient::drain_outbox() noexcept
+	{
+		std::unique_lock lock{m_outbox_mutex};
+		if (m_state != ClientState::Connected)
+			return;
+		for (auto& frame : m_outbox)
+			connection().send(std::move(frame));
+		m_outbox.clear();
+	}
+
+	void SimpleClient::trim_outbox() noexcept
+	{
+		if (m_outbox.size() <= OUTBOX_LIMIT)
+			return;
+		spdlog::warn("Outbox is full, dropping the {} oldest chats", m_outbox.size() - OUTBOX_LIMIT);
+		m_outbox.erase(m_outbox.begin(), m_outbox.end() - static_cast<isize>(OUTBOX_LIMIT));
+	}
+
+	bool SimpleClient::on_disconnect() noexcept
+	{
+		// Rejected by the server, connecting again won't change it
+		if (m_state == ClientState::Closed)
+			return false;
+
+		std::unique_lock lock{m_outbox_mutex};
+		m_state = ClientState::Connecting;
+		// Chats still queued on the dropped connection were never confirmed written, they go out first on the next one
+		auto unsent = connection().take_unsent(MessageType::Chat);
+		m_outbox.insert(m_outbox.begin(), std::make_move_iterator(unsent.begin()), std::make_move_iterator(unsent.end()));
+		trim_outbox();
+		return true;
+	}
+
 	void SimpleClient::username(std::string_view username_) noexcept
 	{
 		{
@@ -77,7 +128,16 @@ namespace ar
 			{
 				auto chat = message_.body_as<ChatMessage>();
 
-				chat.decrypt(m_rng, m_private_key);
+				// Opponent lost the session key of this side, the next chat to it announces the key again
+				if (m_cipher.on_key_request(chat.opponent_id, chat.message))
+					break;
+				if (!chat.decrypt(m_rng, m_cipher, m_decryptor))
+				{
+					spdlog::warn("Chat of {} can't be opened", chat.opponent_id);
+					if (auto request = m_cipher.key_request(chat.opponent_id, chat.message))
+						conn_.send(ChatMessage{ ChatOpponent::User, chat.opponent_id, std::move(*request) });
+					break;
+				}
 				if (m_users.contains(chat.opponent_id))
 				{
 					const CommandMessage cmd{CommandType::RequestPublicKey, {{chat.opponent_id}}};
@@ -97,24 +157,25 @@ namespace ar
 						auto msg = message_.body_as<OnlineListMessage>();
 						for (auto& [id, name] : msg.users)
 						{
+							const auto known = m_users.contains(id);
 							m_users[id].name = std::move(name);
+							if (!known && m_new_user_callback)
+								m_new_user_callback.value()(id, m_users[id]);
 						}
 						break;
 					}
 				case CommandType::RequestPublicKey:
 					{
 						auto msg = message_.body_as<RequestPublicKeyMessage>();
-						auto key = load_public_key(msg.public_key);
-						m_users[msg.opponent_id].public_key = key;
+						m_users[msg.opponent_id].encryptor = make_encryptor(load_public_key(msg.public_key));
 						m_users[msg.opponent_id].has_key = true;
 						break;
 					}
 				case CommandType::RequestUserProperties:
 					{
 						auto msg = message_.body_as<RequestUserPropertiesMessage>();
-						auto key = load_public_key(msg.public_key);
 						m_users[msg.id].name = std::move(msg.username);
-						m_users[msg.id].public_key = key;
+						m_users[msg.id].encryptor = make_encryptor(load_public_key(msg.public_key));
 						m_users[msg.id].has_key = true;
 						break;
 					}
@@ -129,6 +190,12 @@ namespace ar
 				if (m_disconnect_user_callback)
 					m_disconnect_user_callback.value()(msg.id, m_users[msg.id]);
 				m_users.erase(msg.id);
+				m_cipher.forget(msg.id);
+				break;
+			}
+		case MessageType::Session:
+			{
+				m_session = message_.body_as<SessionMessage>();
 				break;
 			}
 		case MessageType::NewUser:
@@ -146,62 +213,150 @@ namespace ar
 		message_type(message_.type());
 	}
 
-	void SimpleClient::start_validation(Connection<ConnectionType::Client>& conn_) noexcept
+	asio::awaitable<bool> SimpleClient::handshake(connection_type& conn_) noexcept
 	{
 		m_state = ClientState::Connecting;
-		conn_.read_once();
-	}
 
-	void SimpleClient::validate(Connection<ConnectionType::Client>& conn_, const Message& msg_) noexcept
-	{
-		m_state = ClientState::Validating;
+		// Server going away before the challenge (restarting, or resetting the socket while accepting) is reconnected like any other drop
+		Message msg{};
+		if (!co_await conn_.read_message(msg) || msg.type() != MessageType::Validation)
+		{
+			conn_.disconnect();
+			co_return false;
+		}
 
-		const auto msg = msg_.body_as<ValidationMessage>();
-		const auto result = encrypt_xor(msg.challenge, KEY);
-		const ValidationMessage val_msg{result};
-		conn_.send(val_msg);
-		conn_.read_once([this](connection_type& conn_, const Message& msg_)
+		conn_.upgrade(msg.body_as<ValidationMessage>().wire_version);
+
+		bool pipelined;
 		{
-			if (!expect_feedback<FeedbackType::ValidationSucceed>(conn_, msg_))
+			std::unique_lock lock{m_username_input_mutex};
+			pipelined = !m_username.empty();
+		}
+
+		bool resumed = false;
+		bool relogin = false;
+		if (m_session)
+		{
+			// Server may still keep the previous session, the key pair is kept as well then
+			m_state = ClientState::Authenticating;
+			conn_.send(ResumeMessage{answer(msg).challenge, *m_session});
+			if (!co_await conn_.read_message(msg))
+				co_return false;
+
+			resumed = msg.type() != MessageType::Feedback || msg.body_as<FeedbackMessage>().data != FeedbackType::ResumeFailed;
+			if (!resumed)
 			{
-				m_state = ClientState::Closed;
-				connection().disconnect();
-				return;
+				// Session is gone on the server, so is everything this side learned during it
+				relogin = true;
+				m_session.reset();
+				forget_users();
+				conn_.send(authentication());
 			}
-			authenticate(conn_);
-		});
+		}
+		else if (pipelined)
+		{
+			// Server replies once with the feedback and the online list
+			m_state = ClientState::Authenticating;
+			conn_.send(HandshakeMessage{answer(msg).challenge, authentication()});
+		}
+		else
+		{
+			m_state = ClientState::Validating;
+			conn_.send(answer(msg));
+
+			if (!co_await conn_.read_message(msg) || !expect_feedback<FeedbackType::ValidationSucceed>(conn_, msg))
+				co_return false;
+
+			m_state = ClientState::Authenticating;
+			conn_.send(authentication());
+		}
+
+		if ((!resumed && !co_await conn_.read_message(msg)) || !expect_feedback<FeedbackType::AuthenticationSucceed>(conn_, msg))
+			co_return false;
+
+		// Plain authentication doesn't bring the online list along like the pipelined one
+		if (relogin)
+			conn_.send(CommandMessage{CommandType::OnlineList, {}});
+
+		{
+			// Everything sent while disconnected goes out on the same write
+			std::unique_lock lock{m_outbox_mutex};
+			for (auto& frame : m_outbox)
+				conn_.send(std::move(frame));
+			m_outbox.clear();
+			m_state = ClientState::Connected;
+		}
+		co_return true;
+	}
+
+	void SimpleClient::forget_users() noexcept
+	{
+		for (auto& [id, user] : m_users)
+		{
+			// Id 0 is the server, it was never announced as a user
+			if (id && m_disconnect_user_callback)
+				m_disconnect_user_callback.value()(id, user);
+		}
+		m_users.clear();
+		m_cipher.clear();
 	}
 
-	void SimpleClient::authenticate(connection_type& conn_) noexcept
+	ValidationMessage SimpleClient::answer(const Message& msg_) const noexcept
 	{
-		m_state = ClientState::Authenticating;
+		const auto msg = msg_.body_as<ValidationMessage>();
+		return ValidationMessage{encrypt_xor(msg.challenge, KEY)};
+	}
 
+	AuthenticateMessage SimpleClient::authentication() noexcept
+	{
 		// Wait until username has value
 		std::unique_lock lock{m_username_input_mutex};
 		m_username_input_cv.wait(lock, [this] { return !m_username.empty(); });
 
-		// Generate Keys
-		auto [private_key, public_key] = generate_keys(m_rng);
-		m_private_key = private_key;
-		m_public_key = public_key;
-		const auto pk = save_public_key(public_key);
-		auto str_pk = fmt::format("{}", pk);
-
+		{
+			std::unique_lock identity_lock{m_identity_mutex};
+			if (m_identity.valid())
+			{
+				// Only waits on the first run, when the key pair is still being generated
+				const auto private_key = m_identity.get();
+				m_decryptor = cry::ElGamal::Decryptor{ private_key };
+				m_public_key = generate_public_key(private_key);
+			}
+		}
+		// Session keys were wrapped for the previous key pair, and the server may have changed its own
+		m_cipher.clear();
+		const auto pk = save_public_key(m_public_key);
 
-		const AuthenticateMessage auth_msg{m_username, pk};
-		conn_.send(auth_msg);
+		return AuthenticateMessage{m_username, pk};
+	}
 
-		conn_.read_once([this](connection_type& conn_, const Message& msg_)
+	void SimpleClient::prepare_identity(bool rotate_) noexcept
+	{
+		auto identity = std::async(std::launch::async, [path = m_identity_path, config = m_key_config, rotate_]
 		{
-			if (!expect_feedback<FeedbackType::AuthenticationSucceed>(conn_, msg_))
+			cry::AutoSeededRandomPool rng{};
+			if (!path.empty() && !rotate_)
 			{
-				m_state = ClientState::Closed;
-				connection().disconnect();
-				return;
+				auto key = load_private_key(path);
+				// Size or group changed in the config, that is a rotation as well
+				if (key && matches_config(rng, *key, config))
+					return std::move(*key);
+				if (key)
+					spdlog::info("Key pair in {} doesn't match the config or isn't valid, generating a new one", path.string());
 			}
-			m_state = ClientState::Connected;
-			connection().start();
+
+			const auto start = std::chrono::steady_clock::now();
+			auto key = generate_private_key(rng, config);
+			spdlog::info("Generated {} bit key pair in {} ms", config.key_size,
+				std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+			if (!path.empty() && !save_private_key(path, key))
+				spdlog::warn("Key pair can't be saved to {}", path.string());
+			return key;
 		});
+
+		std::unique_lock lock{m_identity_mutex};
+		m_identity = std::move(identity);
 	}
 
 	void SimpleClient::message_type(MessageType type_) noexcept
@@ -1,4 +1,8 @@
 ﻿#pragma once
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <future>
 #include <mutex>
 #include <condition_variable>
 
@@ -42,14 +46,25 @@ namespace ar
 		using user_callback = std::optional<std::function<void(u32, User&)>>;
 		using chat_callback = std::optional<std::function<void(u32, Chat&&)>>;
 
-		SimpleClient(const asio::ip::address& addr_, u16 port_);
+		/**
+		 * \brief key pair is loaded from identity_path_ right away in the background, or generated and saved there when it has none of
+		 * key_config_. Empty identity_path_ generates a new key pair per instance without saving it
+		 */
+		SimpleClient(const asio::ip::address& addr_, u16 port_, const KeyConfig& key_config_ = {}, std::filesystem::path identity_path_ = {});
 
+		// false when the server rejected the client or state_ isn't reached in time, drops in between are waited out
 		bool wait_for_state(ClientState state_, std::chrono::milliseconds timeout_ = std::chrono::milliseconds::zero()) const noexcept;
 
 		bool wait_until_state(ClientState state_, std::chrono::time_point<std::chrono::system_clock> timepoint_) const noexcept;
 
 		void wait_for_message(MessageType type_, std::chrono::milliseconds timeout_ = std::chrono::milliseconds::zero()) noexcept;
 
+		/**
+		 * \brief send chat_ on the event loop when connected, otherwise keep it (up to OUTBOX_LIMIT, oldest dropped first) until the next
+		 * handshake succeeds. Chats still queued on a connection that drops are kept the same way
+		 */
+		void send(const ChatMessage& chat_) noexcept;
+
 		[[nodiscard]] ClientState state() const noexcept { return m_state; }
 
 		template<std::invocable<u32, User&> F>
@@ -61,6 +76,7 @@ namespace ar
 		template<std::invocable<u32, Chat&&> F>
 		void set_new_chat_callback(F&& callback_) noexcept;
 
+		// Username set before the challenge comes is sent along with the answer, so the handshake takes a single round trip
 		void username(std::string_view username_) noexcept;
 
 		ptr<User> user(ServerConnection::id_type id_) noexcept;
@@ -69,31 +85,55 @@ namespace ar
 		cry::RandomNumberGenerator& rng() noexcept { return m_rng; }
 		const cry::RandomNumberGenerator& rng() const noexcept { return m_rng; }
 
+		SessionCipher& cipher() noexcept { return m_cipher; }
+
+		// Generate and save a new key pair in the background, the next login presents it
+		void rotate_identity() noexcept;
+
 	private:
 		void on_new_in_message(connection_type& conn_, const Message& message_) noexcept override;
 
 		void on_new_out_message(connection_type& conn_, std::span<const u8> message_) noexcept override {}
 
-		void start_validation(Connection<ConnectionType::Client>& conn_) noexcept override;
+		bool on_disconnect() noexcept override;
+
+		// Move the outbox onto the connection when connected, on the event loop
+		void drain_outbox() noexcept;
+		// Drop the oldest chats above OUTBOX_LIMIT, caller should hold m_outbox_mutex
+		void trim_outbox() noexcept;
+
+		asio::awaitable<bool> handshake(connection_type& conn_) noexcept override;
 
-		void validate(Connection<ConnectionType::Client>& conn_, const Message& msg_) noexcept override;
+		// Users, their keys and the session keys with them belong to the previous session, every user is announced as disconnected
+		void forget_users() noexcept;
+
+		// Answer of the challenge on msg_
+		ValidationMessage answer(const Message& msg_) const noexcept;
 
 		template<FeedbackType Type>
 		bool expect_feedback(connection_type& conn_, const Message& msg_) noexcept;
 
-		void authenticate(connection_type& conn_) noexcept;
+		// Wait for the username, take the key pair over when a new one is ready
+		AuthenticateMessage authentication() noexcept;
+
+		// Load or generate the key pair on another thread, so neither the UI nor the event loop waits for it
+		void prepare_identity(bool rotate_) noexcept;
 
 		void message_type(MessageType type_) noexcept;
 
 	private:
 		MessageType m_last_type;
-		ClientState m_state;
+		std::atomic<ClientState> m_state;	// Written by the event loop, read by the UI
 
 		std::string m_username;
 		std::mutex m_username_input_mutex;
 		std::condition_variable m_username_input_cv;
 
 		user_container m_users;
+		std::optional<SessionMessage> m_session;	// Presented on the next handshake, so a reconnect keeps the id and key pair
+
+		std::mutex m_outbox_mutex;
+		std::deque<shared_frame> m_outbox;	// Chats not handed to the connection yet, or taken back from a dropped one
 
 		SignalerMessage m_signaler;
 
@@ -102,10 +142,16 @@ namespace ar
 		chat_callback m_new_chat_callback;
 
 		cry::AutoSeededRandomPool m_rng{};
-		cry::ElGamal::PrivateKey m_private_key;
+		KeyConfig m_key_config;
+		std::filesystem::path m_identity_path;
+		std::mutex m_identity_mutex;
+		std::future<cry::ElGamal::PrivateKey> m_identity;	// Key pair being loaded or generated, invalid once a login took it over
+		cry::ElGamal::Decryptor m_decryptor;		// Of the private key of this login
 		cry::ElGamal::PublicKey m_public_key;
+		SessionCipher m_cipher;		// Session keys with every user that chats with this one, and with the server
 
 		constexpr static inline std::string_view KEY = "n1odah10"sv;
+		constexpr static inline usize OUTBOX_LIMIT = 256;
 	};
 
 	template <std::invocable<u32, User&> F>
@@ -129,13 +175,17 @@ namespace ar
 	template <FeedbackType Type>
 	bool SimpleClient::expect_feedback(connection_type& conn_, const Message& msg_) noexcept
 	{
-		const auto feedback_message = msg_.body_as<FeedbackMessage>();
-		if (feedback_message.data != Type)
+		if (msg_.type() == MessageType::Feedback && msg_.body_as<FeedbackMessage>().data == Type)
+			return true;
+
+		// Only an explicit rejection stops reconnecting, anything else may be a server that went away mid handshake
+		if (msg_.type() == MessageType::Feedback)
 		{
-			m_state = ClientState::Closed;
-			conn_.disconnect();
-			return false;
+			const auto feedback = msg_.body_as<FeedbackMessage>().data;
+			if (feedback == FeedbackType::ValidationFailed || feedback == FeedbackType::AuthenticationFailed)
+				m_state = ClientState::Closed;
 		}
-		return true;
+		conn_.disconnect();
+		return false;
 	}
 }
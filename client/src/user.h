@@ -8,10 +8,10 @@ namespace ar
 
 	struct User
 	{
-		using public_key_type = cry::ElGamal::PublicKey;
+		using encryptor_type = cry::ElGamal::Encryptor;
 
 		bool has_key{false};
 		std::string name;
-		public_key_type public_key;
+		encryptor_type encryptor;	// Precomputed for the public key of the user, see make_encryptor
 	};
 }
@@ -6,8 +6,14 @@
 
 namespace ar
 {
-	IClient::IClient(const asio::ip::address& address_, u16 port_, IConnectionValidator<ConnectionType::Client>& connection_validator_)
-		: m_endpoint{address_, port_}, m_validator{connection_validator_}, m_server_connection{ m_context, *this, m_validator}
+	IClient::IClient(const asio::ip::address& address_, u16 port_, IConnectionValidator<ConnectionType::Client>& connection_validator_, const ConnectionConfig& connection_config_)
+		: IClient{asio::ip::tcp::endpoint{address_, port_}, connection_validator_, connection_config_}
+	{
+	}
+
+	IClient::IClient(const stream_endpoint& endpoint_, IConnectionValidator<ConnectionType::Client>& connection_validator_, const ConnectionConfig& connection_config_)
+		: m_endpoint{endpoint_}, m_validator{connection_validator_}, m_connection_config{connection_config_}, m_reconnect{false},
+		  m_server_connection{ m_context, *this, m_validator, connection_config_}
 	{
 	}
 
@@ -15,9 +21,10 @@ namespace ar
 	{
 	}
 
-	void IClient::connect(bool separate_thread_) noexcept
+	void IClient::connect(bool separate_thread_, bool shm_ring_) noexcept
 	{
-		m_server_connection.connect(m_endpoint);
+		m_reconnect = true;
+		asio::co_spawn(m_context, run(shm_ring_), asio::detached);
 
 		if (!separate_thread_)
 		{
@@ -30,6 +37,7 @@ namespace ar
 
 	void IClient::disconnect() noexcept
 	{
+		m_reconnect = false;
 		m_server_connection.disconnect();
 
 		if (!m_context.stopped())
@@ -38,4 +46,35 @@ namespace ar
 		if (m_context_thread.joinable())
 			m_context_thread.join();
 	}
+
+	asio::awaitable<void> IClient::run(bool shm_ring_) noexcept
+	{
+		asio::steady_timer timer{ m_context };
+		u32 attempt = 0;
+		while (true)
+		{
+			// Connection that got through the handshake starts the backoff over
+			if (co_await m_server_connection.run(m_endpoint, shm_ring_))
+				attempt = 0;
+
+			if (!m_reconnect || m_connection_config.reconnect_delay == std::chrono::milliseconds::zero() || !on_disconnect())
+				co_return;
+
+			const auto delay = backoff(attempt++);
+			spdlog::info("Connection lost, reconnecting in {}ms", delay.count());
+			asio::error_code ec;
+			timer.expires_after(delay);
+			co_await timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			if (ec || !m_reconnect)
+				co_return;
+		}
+	}
+
+	std::chrono::milliseconds IClient::backoff(u32 attempt_) const noexcept
+	{
+		// Shift is capped, the delay reaches the maximum long before that anyway
+		const auto range = std::min(m_connection_config.reconnect_delay * (i64{ 1 } << std::min<u32>(attempt_, 20)), m_connection_config.reconnect_max_delay);
+		// Jitter spreads clients that dropped at the same time, so they don't come back at once
+		return std::chrono::milliseconds{ generate_random_numbers<i64>(range.count() / 2, range.count()) };
+	}
 }
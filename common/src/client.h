@@ -1,8 +1,9 @@
 ﻿#pragma once
+#include <atomic>
 #include <thread>
 #include <asio/ip/tcp.hpp>
 
-#include "Connection.h"
+#include "connection.h"
 #include "handler.h"
 #include "util/types.h"
 
@@ -13,24 +14,42 @@ namespace ar
 	public:
 		using connection_type = ClientConnection;
 
-		explicit IClient(const asio::ip::address& address_, u16 port_, IConnectionValidator<ConnectionType::Client>& connection_validator_);
+		explicit IClient(const asio::ip::address& address_, u16 port_, IConnectionValidator<ConnectionType::Client>& connection_validator_, const ConnectionConfig& connection_config_ = {});
+		// TCP or AF_UNIX endpoint of the server
+		explicit IClient(const stream_endpoint& endpoint_, IConnectionValidator<ConnectionType::Client>& connection_validator_, const ConnectionConfig& connection_config_ = {});
 		~IClient() override;
 
 		void on_new_in_message(Connection<ConnectionType::Client>& conn_, const Message& message_) noexcept override {};
 		void on_new_out_message(Connection<ConnectionType::Client>& conn_, std::span<const u8> message_) noexcept override {};
 
-		void connect(bool separate_thread_ = true) noexcept;
+		// shm_ring_ sends every frame through a shared memory ring, only for AF_UNIX endpoints the server listens on with a ring
+		void connect(bool separate_thread_ = true, bool shm_ring_ = false) noexcept;
 		void disconnect() noexcept;
 
 		connection_type& connection() noexcept { return m_server_connection; }
 		const connection_type& connection() const noexcept { return m_server_connection; }
 
+	protected:
+		/**
+		 * \brief called every time the connection drops while reconnecting is enabled, on the event loop
+		 * \return false to stop reconnecting
+		 */
+		virtual bool on_disconnect() noexcept { return true; }
+
+	private:
+		// Connect again and again until disconnect or on_disconnect says so
+		asio::awaitable<void> run(bool shm_ring_) noexcept;
+		// Full range doubles on every attempt up to reconnect_max_delay, the delay is taken from its upper half
+		std::chrono::milliseconds backoff(u32 attempt_) const noexcept;
+
 	protected:
 		asio::io_context m_context;
-		asio::ip::tcp::endpoint m_endpoint;
+		stream_endpoint m_endpoint;
 		ref<IConnectionValidator<ConnectionType::Client>> m_validator;
+		ConnectionConfig m_connection_config;
 
 	private:
+		std::atomic<bool> m_reconnect;
 		std::thread m_context_thread;
 		ClientConnection m_server_connection;
 	};
@@ -1,13 +1,26 @@
 ﻿#pragma once
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <span>
 #include <asio.hpp>
 
 #include "util/types.h"
 #include "message/message.h"
+#include "message/frame.h"
+#include "message/frame_decoder.h"
+#include "message/wire.h"
+#include "message/batch.h"
+#include "message/stream.h"
 #include "handler.h"
 #include "util/pointer.h"
 #include "util/asio.h"
+#include "util/registered_buffers.h"
+#include "util/multishot_receive.h"
+#include "util/shm_ring.h"
+#include "util/timing_wheel.h"
+#include "connection_config.h"
+#include "outbound_queue.h"
 
 #include <memory>
 #include <spdlog/spdlog.h>
@@ -18,23 +31,21 @@ namespace ar
 	template<ConnectionType Owner>
 	class Connection;
 
-	template<ConnectionType Owner>
-	constexpr void empty_timeout_callback(Connection<Owner>&) {}
-
-	template<ConnectionType Owner>
-	constexpr void empty_complete_callback(Connection<Owner>&, const Message&) {}
-
+	/**
+	 * \brief owned by std::shared_ptr, running coroutines and pending writes keep it alive and sends from other event loops only hold a std::weak_ptr
+	 */
 	template<>
-	class Connection<ConnectionType::Server>
+	class Connection<ConnectionType::Server> : public std::enable_shared_from_this<Connection<ConnectionType::Server>>
 	{
 	public:
 		using id_type = u32;
-		using socket_type = asio::ip::tcp::socket;
+		using socket_type = stream_socket;
 
-		Connection(id_type id_, asio::ip::tcp::socket&& socket_, IMessageHandler<ConnectionType::Server>& msg_handler_, IConnectionHandler& conn_handler_)
-			: m_on_writing{ false },
-			  m_read_once_timer{std::make_unique<asio::steady_timer>(socket_.get_executor())}, m_id{id_},
-			  m_message_handler{msg_handler_}, m_connection_handler{conn_handler_}, m_header_input_buffer{},
+		Connection(id_type id_, socket_type&& socket_, IMessageHandler<ConnectionType::Server>& msg_handler_, IConnectionHandler& conn_handler_, const ConnectionConfig& config_ = {})
+			: m_on_writing{ false }, m_config{config_}, m_write_count{},
+			  m_deadline{TimingWheel::of(socket_.get_executor()), [this] { on_deadline(); }},
+			  m_idle{m_deadline.wheel(), [this] { on_idle(); }}, m_flush_signal{socket_.get_executor()}, m_id{id_},
+			  m_message_handler{msg_handler_}, m_connection_handler{conn_handler_}, m_decoder{config_.read_buffer_size, config_.max_frame_size}, m_out_messages{config_},
 			  m_socket{std::forward<socket_type>(socket_)}
 		{
 		}
@@ -44,13 +55,28 @@ namespace ar
 
 		Connection(Connection&& other) noexcept
 			: m_on_writing(other.m_on_writing),
-			  m_read_once_timer{std::move(other.m_read_once_timer)},
-			  m_id(other.m_id),
+			  m_config(other.m_config),
+			  m_write_count(other.m_write_count),
+			  m_send_version(other.m_send_version),
+			  m_deadline{other.m_deadline.wheel(), [this] { on_deadline(); }},
+			  m_idle{other.m_idle.wheel(), [this] { on_idle(); }},
+			  m_flush_signal{std::move(other.m_flush_signal)},
+			  m_id(other.m_id.load()),
 			  m_message_handler(other.m_message_handler),
 			  m_connection_handler(other.m_connection_handler),
-			  m_header_input_buffer(std::move(other.m_header_input_buffer)),
+			  m_decoder(std::move(other.m_decoder)),
 			  m_out_messages(std::move(other.m_out_messages)),
+			  m_write_buffers(std::move(other.m_write_buffers)),
+			  m_write_batches(std::move(other.m_write_batches)),
 			  m_input_message(std::move(other.m_input_message)),
+			  m_batch(std::move(other.m_batch)),
+#ifdef AR_HAS_IO_URING
+			  m_receive_slot(std::move(other.m_receive_slot)),
+			  m_multishot(std::move(other.m_multishot)),
+#endif
+#ifdef AR_HAS_SHM_RING
+			  m_ring(std::move(other.m_ring)),
+#endif
 			m_socket(std::move(other.m_socket))
 		{
 		}
@@ -60,191 +86,472 @@ namespace ar
 			if (this == &other)
 				return *this;
 			m_on_writing = other.m_on_writing;
-			m_id = other.m_id;
+			m_config = other.m_config;
+			m_write_count = other.m_write_count;
+			m_send_version = other.m_send_version;
+			m_id = other.m_id.load();
 			m_message_handler = other.m_message_handler;
 			m_connection_handler = other.m_connection_handler;
-			m_header_input_buffer = std::move(other.m_header_input_buffer);
+			m_decoder = std::move(other.m_decoder);
 			m_out_messages = std::move(other.m_out_messages);
+			m_write_buffers = std::move(other.m_write_buffers);
+			m_write_batches = std::move(other.m_write_batches);
 			m_input_message = std::move(other.m_input_message);
+			m_batch = std::move(other.m_batch);
 			m_socket = std::move(other.m_socket);
-			m_read_once_timer = std::move(other.m_read_once_timer);
+			m_deadline.cancel();
+			m_idle.cancel();
+			m_flush_signal = std::move(other.m_flush_signal);
+#ifdef AR_HAS_IO_URING
+			m_multishot = std::move(other.m_multishot);
+			m_decoder.detach();
+			m_receive_slot.reset();
+			if (other.m_receive_slot)
+				m_receive_slot.emplace(std::move(*other.m_receive_slot));
+#endif
+#ifdef AR_HAS_SHM_RING
+			m_ring = std::move(other.m_ring);
+#endif
 
 			other.m_id = 0;
 			return *this;
 		}
 
+		// Connection handler is done with it by now
 		~Connection() noexcept
 		{
-			close();
+			release();
+		}
+
+		/**
+		 * \brief run the handshake of the connection handler on the event loop that owns this connection, then keep reading once it is accepted.
+		 * With shm_ring_ the peer first passes a ShmRing over the AF_UNIX socket and every frame it sends comes through the ring
+		 */
+		void establish(bool shm_ring_ = false) noexcept
+		{
+			asio::co_spawn(m_socket.get_executor(), run(shm_ring_, shared_from_this()), asio::detached);
 		}
 
+		/**
+		 * \brief read continuously without handshake, every message is passed to IMessageHandler
+		 */
 		void start() noexcept
 		{
-			read_header<true>();
+			asio::co_spawn(m_socket.get_executor(), read_loop(shared_from_this()), asio::detached);
 		}
 
 		void close() noexcept
 		{
 			if (!is_connected())
 				return;
+			// Handler drops its reference, the one of the caller may be the only one left
+			const auto self = weak_from_this().lock();
 			m_connection_handler->remove_connection(*this);
-			m_socket.close();
+			release();
 		}
 
 		/**
-		 * \brief do async_read only once
+		 * \brief read the next message into msg_, frame that is already buffered is returned without touching the socket
+		 * \return false when the read failed, the connection is left to the caller
 		 */
-		template<std::invocable<Connection&> F = decltype(empty_timeout_callback<ConnectionType::Server>), std::invocable<Connection&, const Message&> F1 = decltype(empty_complete_callback<ConnectionType::Server>)>
-		void read_timed(const std::chrono::milliseconds& timeout_, F1&& complete_callback_ = empty_complete_callback<ConnectionType::Server>, F&& timeout_callback_ = empty_timeout_callback<ConnectionType::Server>) noexcept
+		asio::awaitable<bool> read_message(Message& msg_) noexcept
 		{
-			constexpr bool has_complete_handler = !std::is_same_v<F1, decltype(empty_complete_callback<ConnectionType::Server>)>;
-			constexpr bool has_timeout_handler = !std::is_same_v<F, decltype(empty_timeout_callback<ConnectionType::Server>)>;
-			read_header<false, true, !has_complete_handler>();
-
-			if (timeout_ != std::chrono::milliseconds::zero())
+			while (!next_message(msg_))
 			{
-				m_read_once_timer->expires_after(timeout_);
-				m_read_once_timer->async_wait([cf = std::forward<F1>(complete_callback_), tf = std::forward<F>(timeout_callback_), this](const asio::error_code& ec_)
+				if (m_decoder.is_oversized())
 				{
-						// Timer callback only got called when the timer is expired
-						if (!ec_)
-						{
-							if constexpr (has_timeout_handler)
-								std::invoke(tf, *this);
-						}
-						// 
-						else
-						{
-							if constexpr (has_complete_handler)
-								std::invoke(cf, *this, m_input_message);
-						}
-				});
+					spdlog::warn("Frame is bigger than {} bytes, the peer should stream it instead", m_config.max_frame_size);
+					co_return false;
+				}
+
+				asio::error_code ec;
+				const auto buffer = m_decoder.prepare();
+#ifdef AR_HAS_SHM_RING
+				if (m_ring)
+				{
+					if (!co_await read_ring(buffer))
+						co_return false;
+					continue;
+				}
+#endif
+				usize bytes;
+#ifdef AR_HAS_IO_URING
+				if (m_multishot)
+				{
+					std::tie(ec, bytes) = co_await m_multishot->read(buffer, m_read_cancel.slot());
+					// Nothing was received, the socket is read directly from now on
+					if (ec == asio::error::operation_not_supported)
+					{
+						m_multishot.reset();
+						continue;
+					}
+				}
+				// Fixed buffer read while the decoder still receives into the registered slot
+				else if (const auto registered = m_receive_slot ? m_receive_slot->buffer(buffer) : std::nullopt)
+					bytes = co_await m_socket.async_read_some(*registered, asio::bind_cancellation_slot(m_read_cancel.slot(), asio::redirect_error(asio::use_awaitable, ec)));
+				else
+#endif
+					bytes = co_await m_socket.async_read_some(asio::buffer(buffer.data(), buffer.size()), asio::bind_cancellation_slot(m_read_cancel.slot(), asio::redirect_error(asio::use_awaitable, ec)));
+				if (ec)
+					co_return false;
+				m_decoder.commit(bytes);
 			}
+			co_return true;
 		}
 
 		/**
-		 * \brief do async_read only once, commonly used for handshake protocol
+		 * \brief read_message bounded by timeout_, the pending read is cancelled when the deadline comes first
 		 */
-		template<std::invocable<Connection&, const Message&> F = decltype(empty_complete_callback<ConnectionType::Server>)>
-		void read_once(F&& complete_callback_ = empty_complete_callback<ConnectionType::Server>) noexcept
+		asio::awaitable<bool> read_message(Message& msg_, std::chrono::milliseconds timeout_) noexcept
 		{
-			constexpr bool has_complete_handler = !std::is_same_v<F, decltype(empty_complete_callback<ConnectionType::Server>)>;
-			read_header<false, false, !has_complete_handler>();
-
-			// if (m_read_once_timer->expiry() > asio::steady_timer::clock_type::now())
-			m_read_once_timer->expires_after(10000s);
-			m_read_once_timer->async_wait([cf = std::forward<F>(complete_callback_), this](const asio::error_code& ec_)
-				{
-					// callback will be called when the timer is cancelled, which will be on message_handler
-					if (ec_)
-					{
-						if constexpr (has_complete_handler)
-							std::invoke(cf, *this, m_input_message);
-					}
-				});
+			m_deadline.arm(timeout_);
+			const auto result = co_await read_message(msg_);
+			m_deadline.cancel();
+			co_return result;
 		}
 
 		void send(const Message& msg_)
 		{
-			send(msg_.serialize());
+			send(make_frame(msg_));
 		}
 
 		template<Serializable T>
 		void send(const T& msg_) noexcept {
-			send(Message{msg_});
+			send(make_frame(msg_));
+		}
+
+		/**
+		 * \brief enqueue already serialized frame, the same frame can be shared by many connections.
+		 * Safe to call from any event loop, the queue itself is only touched by the event loop that owns this connection
+		 */
+		void send(shared_frame frame_)
+		{
+			// Connection that is gone by the time the event loop gets to it just drops the frame
+			asio::dispatch(m_socket.get_executor(), [this, weak = weak_from_this(), frame = std::move(frame_)]() mutable
+			{
+				const auto self = weak.lock();
+				if (!self || !is_connected())
+					return;
+				if (!m_out_messages.push(std::move(frame), m_write_count))
+				{
+					spdlog::warn("[{}] Outbound queue is full ({} bytes), closing slow consumer", id(), m_out_messages.bytes());
+					close();
+					return;
+				}
+
+				if (m_on_writing)
+					return;
+				write_pending();
+			});
+		}
+
+		/**
+		 * \brief send and wait until every frame queued on this connection so far is written, should be awaited on the event loop that owns this connection
+		 * \return false when the connection is closed before the queue is flushed
+		 */
+		asio::awaitable<bool> async_send(shared_frame frame_) noexcept
+		{
+			send(std::move(frame_));
+			co_return co_await flush();
+		}
+
+		template<Serializable T>
+		asio::awaitable<bool> async_send(const T& msg_) noexcept
+		{
+			return async_send(make_frame(msg_));
+		}
+
+		/**
+		 * \brief send body_ as StreamChunk frames of ConnectionConfig::stream_chunk_size, the next chunk is only queued once the previous one is written
+		 * so neither side holds more than a chunk of it. body_ should stay alive until the returned awaitable completes
+		 */
+		asio::awaitable<bool> async_send_stream(MessageType type_, std::span<const u8> body_) noexcept
+		{
+			const auto id = ++m_last_stream_id;
+			usize offset = 0;
+			do
+			{
+				const auto size = std::min(m_config.stream_chunk_size, body_.size() - offset);
+				if (!co_await async_send(make_stream_frame(id, type_, body_.size(), offset, body_.subspan(offset, size))))
+					co_return false;
+				offset += size;
+			} while (offset < body_.size());
+			co_return true;
+		}
+
+		/**
+		 * \brief wait until every frame queued so far is written
+		 * \return false when the connection is closed before the queue is flushed
+		 */
+		asio::awaitable<bool> flush() noexcept
+		{
+			while (is_connected() && (m_on_writing || !m_out_messages.empty()))
+			{
+				asio::error_code ec;
+				m_flush_signal.expires_at(asio::steady_timer::time_point::max());
+				co_await m_flush_signal.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			}
+			co_return is_connected();
 		}
 
 		id_type id() const noexcept { return m_id; }
+		// Resumed session takes the id of the previous connection over, only the connection handler should change it
+		void id(id_type id_) noexcept { m_id = id_; }
 		socket_type& socket() noexcept { return m_socket; }
 		const socket_type& socket() const noexcept { return m_socket; }
 		bool is_connected() const noexcept { return m_socket.is_open(); }
 
 	private:
-		void send(std::span<const u8> msg_)
+		// self_ keeps the connection alive until the coroutine completes
+		asio::awaitable<void> run(bool shm_ring_, std::shared_ptr<Connection> self_) noexcept
 		{
-			m_out_messages.emplace(msg_.begin(), msg_.end());
-
-			if (m_on_writing)
-				return;
-			m_on_writing = true;
-			asio::async_write(m_socket, asio::buffer(m_out_messages.front(), m_out_messages.front().size()), [&](const asio::error_code& ec_, size_t a)
+#ifdef AR_HAS_SHM_RING
+			if (shm_ring_ && !co_await receive_ring())
 			{
-				handle_write(ec_);
-			});
+				close();
+				co_return;
+			}
+#endif
+			attach_receive_slot();
+			if (co_await m_connection_handler->handshake(*this))
+				co_await read_loop(std::move(self_));
 		}
 
-		// TODO: Using enum class with Bitmask, instead of 3 booleans
-		template<bool Continuous, bool Timed = false, bool Handle = true>
-		void read_header() noexcept
+		/**
+		 * \brief slice the next buffered message into msg_, Batch frames are unpacked first. Version frame of the client is answered here,
+		 * neither of them reaches the handlers
+		 */
+		bool next_message(Message& msg_) noexcept
 		{
-			static_assert((Continuous && !Timed) || (!Continuous && Timed) || (!Continuous && !Timed), "Couldn't do continuous read with timed turned on, Timed can only be used for Non-continuous read");
-			static_assert((Continuous && Handle) || (!Continuous && (Handle || !Handle)), "Continuous read should be handled by IMessageHandler");
-
-			asio::async_read(m_socket, asio::buffer(m_header_input_buffer, Message::header_size), [&](const asio::error_code& ec_, [[maybe_unused]] size_t)
+			while (m_batch.next(msg_) || m_decoder.next(msg_))
 			{
-				if constexpr (Timed)
+				// Only comes from the decoder, m_batch is drained first and never yields one
+				if (msg_.type() == MessageType::Batch)
 				{
-					if (m_read_once_timer->expiry() < asio::steady_timer::clock_type::now())
-						return;
+					m_batch.reset(msg_);
+					continue;
 				}
-				handle_read_header<Continuous, Handle>(ec_);
-			});
+				if (msg_.type() != MessageType::Version)
+					return true;
+
+				VersionMessage version{};
+				if (!version.deserialize(msg_.body))
+					continue;
+				version.version = std::clamp(version.version, WireVersion::V1, max_wire_version);
+				m_decoder.version(version.version);
+				// Last frame this side sends with the current framing, see write_pending
+				send(version);
+			}
+			return false;
 		}
 
-		template<bool Continuous, bool Handle>
-		void read_body() noexcept
+		/**
+		 * \brief dispatch every message until the read fails, each complete frame on a single read is dispatched before reading again
+		 */
+		asio::awaitable<void> read_loop([[maybe_unused]] std::shared_ptr<Connection> self_) noexcept
 		{
-			m_input_message.resize_body();
-			asio::async_read(m_socket, asio::buffer(m_input_message.body, m_input_message.header.body_size), [&](const asio::error_code& ec_, [[maybe_unused]] size_t bytes_) {handle_read_body<Continuous, Handle>(ec_); });
+			attach_receive_slot();
+			rearm_idle();
+			while (co_await read_message(m_input_message))
+			{
+				rearm_idle();
+				if (!dispatch(m_input_message))
+					break;
+				if (!is_connected())
+					co_return;
+			}
+			close();
 		}
 
-		template<bool Continuous, bool Handle>
-		void handle_read_header(const asio::error_code& ec_) noexcept
+		/**
+		 * \brief hand msg_ to the message handler, stream chunks are handed one by one as well
+		 * \return false when the message is malformed
+		 */
+		bool dispatch(const Message& msg_) noexcept
 		{
-			if (ec_)
+			if (msg_.type() != MessageType::Stream)
+			{
+				m_message_handler->on_new_in_message(*this, msg_);
+				return true;
+			}
+
+			StreamChunk chunk{};
+			if (!chunk.deserialize(msg_.body))
+				return false;
+			m_message_handler->on_new_in_stream(*this, chunk);
+			return true;
+		}
+
+		// Stop every pending operation, the connection handler isn't told
+		void release() noexcept
+		{
+#ifdef AR_HAS_IO_URING
+			// Before the socket, the armed receive holds its file open
+			m_multishot.reset();
+#endif
+			m_socket.close();
+			m_deadline.cancel();
+			m_idle.cancel();
+			m_flush_signal.cancel();
+#ifdef AR_HAS_IO_URING
+			m_decoder.detach();
+			m_receive_slot.reset();
+#endif
+#ifdef AR_HAS_SHM_RING
+			if (m_ring)
+				m_ring->close();
+#endif
+		}
+
+		void rearm_idle() noexcept
+		{
+			if (m_config.idle_timeout != std::chrono::seconds::zero())
+				m_idle.arm(m_config.idle_timeout);
+		}
+
+		void on_deadline() noexcept
+		{
+			spdlog::warn("[{}] Timed out waiting for message", id());
+			m_read_cancel.emit(asio::cancellation_type::terminal);
+		}
+
+		void on_idle() noexcept
+		{
+			spdlog::info("[{}] Nothing received for {}s, closing", id(), m_config.idle_timeout.count());
+			close();
+		}
+
+#ifdef AR_HAS_SHM_RING
+		/**
+		 * \brief take the ring the peer passes as the first byte on the socket, the socket only carries frames to the peer afterwards
+		 */
+		asio::awaitable<bool> receive_ring() noexcept
+		{
+			asio::error_code ec;
+			co_await m_socket.async_wait(asio::socket_base::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+			if (!ec)
+				m_ring = ShmRing::receive_from(m_socket.get_executor(), m_socket.native_handle(), m_config.shm_ring_capacity);
+			if (!m_ring)
 			{
-				// socket closed
-				if (is_disconnect_error(ec_))
+				spdlog::warn("[{}] Peer didn't pass a shared memory ring", id());
+				co_return false;
+			}
+
+			asio::co_spawn(m_socket.get_executor(), watch_peer(shared_from_this()), asio::detached);
+			co_return true;
+		}
+
+		/**
+		 * \brief the ring can't tell a crashed peer from an idle one, the peer never sends on the socket again so it only becomes readable once the peer is gone
+		 */
+		asio::awaitable<void> watch_peer([[maybe_unused]] std::shared_ptr<Connection> self_) noexcept
+		{
+			asio::error_code ec;
+			co_await m_socket.async_wait(asio::socket_base::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+			if (ec != asio::error::operation_aborted)
+				close();
+		}
+
+		/**
+		 * \brief read from the ring into buffer_, sleeping on its eventfd only while it is empty
+		 */
+		asio::awaitable<bool> read_ring(std::span<u8> buffer_) noexcept
+		{
+			while (true)
+			{
+				const auto bytes = m_ring->read(buffer_);
+				if (!bytes)
 				{
-					close();
-					return;
+					spdlog::warn("[{}] Shared memory ring is corrupted", id());
+					co_return false;
+				}
+				if (*bytes)
+				{
+					m_decoder.commit(*bytes);
+					co_return true;
 				}
+				if (co_await m_ring->wait_readable(m_read_cancel.slot()))
+					co_return false;
+			}
+		}
+#endif
 
-				if constexpr (Continuous)
-					read_header<true>();
+		/**
+		 * \brief receive through the multishot receive of this event loop, or into a slot registered on its io_uring when it has any left
+		 */
+		void attach_receive_slot() noexcept
+		{
+#ifdef AR_HAS_IO_URING
+			if (m_receive_slot || m_multishot || !is_connected())
 				return;
-			}
-			if (!m_input_message.parse_header(m_header_input_buffer))
-			{
-				if constexpr (Continuous)
-					read_header<true>();
+#ifdef AR_HAS_SHM_RING
+			// Nothing is read from the socket
+			if (m_ring)
 				return;
+#endif
+
+			auto& context = asio::query(m_socket.get_executor(), asio::execution::context);
+			if (asio::has_service<MultishotReceiver>(context))
+			{
+				m_multishot = asio::use_service<MultishotReceiver>(context).subscribe(m_socket.get_executor(), m_socket.native_handle());
+				if (m_multishot)
+					return;
 			}
-			read_body<Continuous, Handle>();
+			if (!asio::has_service<RegisteredBuffers>(context))
+				return;
+
+			m_receive_slot = asio::use_service<RegisteredBuffers>(context).acquire();
+			if (m_receive_slot)
+				m_decoder.attach(m_receive_slot->memory());
+#endif
 		}
 
-		template<bool Continuous, bool Handle>
-		void handle_read_body(const asio::error_code& ec_) noexcept
+		/**
+		 * \brief gather every queued frame (bounded by ConnectionConfig) into a single write
+		 */
+		void write_pending() noexcept
 		{
-			if (ec_)
+			usize bytes = 0;
+			m_write_count = 0;
+			m_write_buffers.clear();
+			m_write_batches.clear();
+			for (auto it = m_out_messages.begin(); it != m_out_messages.end();)
 			{
-				// socket closed
-				if (is_disconnect_error(ec_))
+				// Run of small frames goes out as a single Batch frame
+				const auto count = m_send_version >= WireVersion::V2 && m_config.batch_max_body
+					? m_out_messages.batch_length(it, m_config.batch_max_body, m_config.max_write_bytes) : 1;
+				const auto& msg = count > 1 ? m_write_batches.emplace_back(make_batch_frame(it, it + static_cast<isize>(count))) : *it;
+
+				const auto header = msg->header(m_send_version);
+				const auto size = header.size() + msg->body().size();
+				// V1 frame goes out as one buffer, V2 as its header and its body
+				const usize buffers = m_send_version == WireVersion::V1 ? 1 : 2;
+				// Always take the first frame, even when it is bigger than the caps
+				if (m_write_count && (m_write_buffers.size() + buffers > m_config.max_write_buffers || bytes + size > m_config.max_write_bytes))
+					break;
+
+				if (m_send_version == WireVersion::V1)
+					m_write_buffers.emplace_back(msg->data(), msg->size());
+				else
 				{
-					close();
-					return;
+					m_write_buffers.emplace_back(header.data(), header.size());
+					m_write_buffers.emplace_back(msg->body().data(), msg->body().size());
+					wire_counters().count(msg->type(), header.size());
 				}
-				// close();
-			}
-			else
-			{
-				m_read_once_timer->cancel_one();
-				if constexpr (Handle)
-					handle_message();
+				bytes += size;
+				m_write_count += count;
+				it += static_cast<isize>(count);
+
+				// Frames are framed in the order they go out, so every frame behind the Version frame takes its version
+				if (msg->type() == MessageType::Version)
+					m_send_version = static_cast<WireVersion>(msg->body()[0]);
 			}
 
-			if constexpr (Continuous)
-				read_header<true>();
+			m_on_writing = true;
+			asio::async_write(m_socket, m_write_buffers, [this, self = shared_from_this()](const asio::error_code& ec_, size_t)
+			{
+				handle_write(ec_);
+			});
 		}
 
 		void handle_write(const asio::error_code& ec_)
@@ -256,43 +563,51 @@ namespace ar
 				return;
 			}
 
-			m_message_handler->on_new_out_message(*this, m_out_messages.front());
+			for (; m_write_count; --m_write_count)
+			{
+				m_message_handler->on_new_out_message(*this, m_out_messages.front()->bytes());
+				m_out_messages.pop_front();
+			}
 
-			m_out_messages.pop();
 			if (m_out_messages.empty())
 			{
 				m_on_writing = false;
+				m_flush_signal.cancel();
 				return;
 			}
 
-			asio::async_write(m_socket, asio::buffer(m_out_messages.front(), m_out_messages.front().size()), [&](const asio::error_code& ec_, size_t a)
-			{
-				handle_write(ec_);
-			});
-		}
-
-		void handle_message()
-		{
-			if (m_input_message.type() == MessageType::Validation)
-			{
-				m_connection_handler->validate(*this, m_input_message);
-			}
-			else
-				m_message_handler->on_new_in_message(*this, m_input_message);
+			write_pending();
 		}
 
 	private:
 		bool m_on_writing;
-		std::unique_ptr<asio::steady_timer> m_read_once_timer;
+		ConnectionConfig m_config;
+		usize m_write_count;	// Frames owned by the in-flight write
+		WireVersion m_send_version{WireVersion::V1};	// Framing of the next gathered frame
+		WheelTimer m_deadline;		// Armed only by timed read_message, cancels the pending read through m_read_cancel
+		WheelTimer m_idle;			// Re-armed on every message when ConnectionConfig::idle_timeout is set
+		asio::cancellation_signal m_read_cancel;
+		asio::steady_timer m_flush_signal;	// Never expires, cancelled to wake flush once the queue is flushed
+		StreamChunk::id_type m_last_stream_id{};
 
-		id_type m_id;
+		std::atomic<id_type> m_id;	// Rewritten by the connection handler on another event loop when a session is resumed
 
 		ref<IMessageHandler<ConnectionType::Server>> m_message_handler;
 		ref<IConnectionHandler> m_connection_handler;
 
-		std::array<u8, Message::header_size> m_header_input_buffer;
-		std::queue<std::vector<u8>> m_out_messages;
+		FrameDecoder m_decoder;
+		OutboundQueue m_out_messages;	// Frame is released once the write that carries it completes
+		std::vector<asio::const_buffer> m_write_buffers;
+		std::vector<shared_frame> m_write_batches;	// Batch frames built by the in-flight write
 		Message m_input_message;
+		BatchReader m_batch;	// Rest of the last received Batch frame
+#ifdef AR_HAS_IO_URING
+		std::optional<RegisteredSlot> m_receive_slot;	// Returned to the event loop on close, m_decoder is detached from it first
+		std::optional<MultishotStream> m_multishot;		// Takes the place of m_receive_slot when the event loop supports it
+#endif
+#ifdef AR_HAS_SHM_RING
+		std::optional<ShmRing> m_ring;	// Frames of the peer come through it instead of the socket
+#endif
 		socket_type m_socket;
 	};
 
@@ -300,13 +615,14 @@ namespace ar
 	class Connection<ConnectionType::Client>
 	{
 	public:
-		using socket_type = asio::ip::tcp::socket;
+		using socket_type = stream_socket;
 		using message_handler_type = IMessageHandler<ConnectionType::Client>;
 
-		Connection(asio::io_context& context_, message_handler_type& msg_handler_, IConnectionValidator<ConnectionType::Client>& validator_)
-			: m_on_writing{ false }/*, m_is_closed{ false }*/, m_read_once_timer{ std::make_unique<asio::steady_timer>(context_) },
+		Connection(asio::io_context& context_, message_handler_type& msg_handler_, IConnectionValidator<ConnectionType::Client>& validator_, const ConnectionConfig& config_ = {})
+			: m_on_writing{ false }/*, m_is_closed{ false }*/, m_config{config_}, m_write_count{},
+			  m_deadline{ TimingWheel::of(context_), [this] { on_deadline(); } }, m_flush_signal{ context_ },
 			  m_message_handler{ msg_handler_ },
-			  m_validation_handler{validator_}, m_header_input_buffer{}, m_socket{context_}
+			  m_validation_handler{validator_}, m_decoder{config_.read_buffer_size, config_.max_frame_size}, m_out_messages{config_}, m_socket{context_}
 		{
 		}
 
@@ -315,12 +631,22 @@ namespace ar
 
 		Connection(Connection&& other) noexcept
 			: m_on_writing(other.m_on_writing)/*, m_is_closed{ other.m_is_closed}*/,
-			  m_read_once_timer{std::move(other.m_read_once_timer)},
+			  m_config(other.m_config),
+			  m_write_count(other.m_write_count),
+			  m_send_version(other.m_send_version),
+			  m_deadline{other.m_deadline.wheel(), [this] { on_deadline(); }},
+			  m_flush_signal{std::move(other.m_flush_signal)},
 			  m_message_handler(other.m_message_handler),
 			  m_validation_handler(other.m_validation_handler),
-			  m_header_input_buffer(std::move(other.m_header_input_buffer)),
+			  m_decoder(std::move(other.m_decoder)),
 			  m_out_messages(std::move(other.m_out_messages)),
+			  m_write_buffers(std::move(other.m_write_buffers)),
+			  m_write_batches(std::move(other.m_write_batches)),
 			  m_input_message(std::move(other.m_input_message)),
+			  m_batch(std::move(other.m_batch)),
+#ifdef AR_HAS_SHM_RING
+			  m_ring(std::move(other.m_ring)),
+#endif
 			m_socket(std::move(other.m_socket))
 		{
 		}
@@ -330,13 +656,23 @@ namespace ar
 			if (this == &other)
 				return *this;
 			m_on_writing = other.m_on_writing;
+			m_config = other.m_config;
+			m_write_count = other.m_write_count;
+			m_send_version = other.m_send_version;
 			m_message_handler = other.m_message_handler;
 			m_validation_handler = other.m_validation_handler;
-			m_header_input_buffer = std::move(other.m_header_input_buffer);
+			m_decoder = std::move(other.m_decoder);
 			m_out_messages = std::move(other.m_out_messages);
+			m_write_buffers = std::move(other.m_write_buffers);
+			m_write_batches = std::move(other.m_write_batches);
 			m_input_message = std::move(other.m_input_message);
+			m_batch = std::move(other.m_batch);
 			m_socket = std::move(other.m_socket);
-			m_read_once_timer = std::move(other.m_read_once_timer);
+			m_deadline.cancel();
+			m_flush_signal = std::move(other.m_flush_signal);
+#ifdef AR_HAS_SHM_RING
+			m_ring = std::move(other.m_ring);
+#endif
 			// m_is_closed = other.m_is_closed;
 			return *this;
 		}
@@ -346,9 +682,12 @@ namespace ar
 			disconnect();
 		}
 
+		/**
+		 * \brief read continuously without handshake, every message is passed to IMessageHandler
+		 */
 		void start() noexcept
 		{
-			read_header<true>();
+			asio::co_spawn(m_socket.get_executor(), read_loop(), asio::detached);
 		}
 
 		void disconnect() noexcept
@@ -357,229 +696,398 @@ namespace ar
 				return;
 			// m_is_closed = true;
 			m_socket.close();
+			m_deadline.cancel();
+			m_flush_signal.cancel();
+#ifdef AR_HAS_SHM_RING
+			if (m_ring)
+				m_ring->close();
+#endif
 		}
 
 		/**
-		 * \brief do async_read only once and have timer on it
+		 * \brief read the next message into msg_, frame that is already buffered is returned without touching the socket
+		 * \return false when the read failed, the connection is left to the caller
 		 */
-		template<std::invocable<Connection&> F = decltype(empty_timeout_callback<ConnectionType::Client>), std::invocable<Connection&, const Message&> F1 = decltype(empty_complete_callback<ConnectionType::Client>)>
-		void read_timed(const std::chrono::milliseconds& timeout_, F1&& complete_callback_ = empty_complete_callback<ConnectionType::Client>, F&& timeout_callback_ = empty_timeout_callback<ConnectionType::Client>) noexcept
+		asio::awaitable<bool> read_message(Message& msg_) noexcept
 		{
-			constexpr bool has_handler = !std::is_same_v<F1, decltype(empty_complete_callback<ConnectionType::Client>)>;
-			constexpr bool has_timeout_callback = !std::is_same_v<F, decltype(empty_timeout_callback<ConnectionType::Client>)>;
-			if (timeout_ == std::chrono::milliseconds::zero())
-				return
-			read_header<false, true, !has_handler>();
-
-			m_read_once_timer->expires_after(timeout_);
-			m_read_once_timer->async_wait([cf = std::forward<F1>(complete_callback_), tf = std::forward<F>(timeout_callback_), this](const asio::error_code& ec_)
+			while (!next_message(msg_))
+			{
+				if (m_decoder.is_oversized())
 				{
-					// Timer callback only got called when the timer is expired
-					if (!ec_)
-					{
-						if constexpr (has_timeout_callback)
-							std::invoke(tf, *this);
-					}
-					// 
-					else
-					{
-						if constexpr (has_handler)
-							std::invoke(cf, *this, m_input_message);
-					}
-				});
+					spdlog::warn("Frame is bigger than {} bytes, the peer should stream it instead", m_config.max_frame_size);
+					co_return false;
+				}
+
+				asio::error_code ec;
+				const auto buffer = m_decoder.prepare();
+				const auto bytes = co_await m_socket.async_read_some(asio::buffer(buffer.data(), buffer.size()), asio::bind_cancellation_slot(m_read_cancel.slot(), asio::redirect_error(asio::use_awaitable, ec)));
+				if (ec)
+					co_return false;
+				m_decoder.commit(bytes);
+			}
+			co_return true;
 		}
 
 		/**
-		 * \brief do async_read only once
+		 * \brief read_message bounded by timeout_, the pending read is cancelled when the deadline comes first
 		 */
-		template<std::invocable<Connection&, const Message&> F = decltype(empty_complete_callback<ConnectionType::Client>)>
-		void read_once(F&& complete_callback_ = empty_complete_callback<ConnectionType::Client>) noexcept
+		asio::awaitable<bool> read_message(Message& msg_, std::chrono::milliseconds timeout_) noexcept
 		{
-            using namespace std::chrono_literals;
-			constexpr bool handle_by_handler = std::is_same_v<F, decltype(empty_complete_callback<ConnectionType::Client>)>;
-			read_header<false, false, handle_by_handler>();
-
-			m_read_once_timer->expires_after(10000s);
-			m_read_once_timer->async_wait([cb = std::forward<F>(complete_callback_), this](const asio::error_code& ec_)
-				{
-					// callback will be called when the timer is cancelled, which will be on message_handler
-					if (ec_)
-					{
-						if constexpr (!handle_by_handler)
-							std::invoke(cb, *this, m_input_message);
-					}
-				});
+			m_deadline.arm(timeout_);
+			const auto result = co_await read_message(msg_);
+			m_deadline.cancel();
+			co_return result;
 		}
-        
+
 		void send(const Message& msg_) noexcept
 		{
-			send(msg_.serialize());
+			send(make_frame(msg_));
 		}
 
 		template<Serializable T>
 		void send(const T& msg_) noexcept {
-			send(Message{msg_});
+			send(make_frame(msg_));
 		}
 
-		void connect(const asio::ip::tcp::endpoint& endpoint_) noexcept
+		/**
+		 * \brief enqueue already serialized frame. Safe to call from any thread, the queue itself is only touched by the event loop
+		 */
+		void send(shared_frame frame_)
 		{
-			m_socket.async_connect(endpoint_, [&](const asio::error_code& ec_)
+			asio::dispatch(m_socket.get_executor(), [this, frame = std::move(frame_)]() mutable
+			{
+				if (!m_out_messages.push(std::move(frame), m_write_count))
 				{
-					if (ec_)
-					{
-						m_socket.close();
-						return;
-					}
+					spdlog::warn("Outbound queue is full ({} bytes), disconnecting", m_out_messages.bytes());
+					disconnect();
+					return;
+				}
 
-					// Validation
-					m_validation_handler->start_validation(*this);
-				});
+				if (m_on_writing)
+					return;
+				write_pending();
+			});
 		}
 
-		void connect(const asio::ip::tcp::resolver::results_type& endpoints_, asio::ip::tcp::endpoint& result_) noexcept
+		/**
+		 * \brief send and wait until every frame queued so far is written
+		 * \return false when the connection is closed before the queue is flushed
+		 */
+		asio::awaitable<bool> async_send(shared_frame frame_) noexcept
 		{
-			asio::async_connect(m_socket, endpoints_, [&](const asio::error_code& ec_, const asio::ip::tcp::endpoint& ep_)
-				{
-					if (ec_)
-						return;
-					result_ = ep_;
-				});
+			send(std::move(frame_));
+			co_return co_await flush();
+		}
+
+		template<Serializable T>
+		asio::awaitable<bool> async_send(const T& msg_) noexcept
+		{
+			return async_send(make_frame(msg_));
+		}
+
+		/**
+		 * \brief send body_ as StreamChunk frames of ConnectionConfig::stream_chunk_size, the next chunk is only queued once the previous one is written
+		 * so neither side holds more than a chunk of it. body_ should stay alive until the returned awaitable completes
+		 */
+		asio::awaitable<bool> async_send_stream(MessageType type_, std::span<const u8> body_) noexcept
+		{
+			const auto id = ++m_last_stream_id;
+			usize offset = 0;
+			do
+			{
+				const auto size = std::min(m_config.stream_chunk_size, body_.size() - offset);
+				if (!co_await async_send(make_stream_frame(id, type_, body_.size(), offset, body_.subspan(offset, size))))
+					co_return false;
+				offset += size;
+			} while (offset < body_.size());
+			co_return true;
+		}
+
+		/**
+		 * \brief wait until every frame queued so far is written
+		 * \return false when the connection is closed before the queue is flushed
+		 */
+		asio::awaitable<bool> flush() noexcept
+		{
+			while (is_connected() && (m_on_writing || !m_out_messages.empty()))
+			{
+				asio::error_code ec;
+				m_flush_signal.expires_at(asio::steady_timer::time_point::max());
+				co_await m_flush_signal.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			}
+			co_return is_connected();
+		}
+
+		/**
+		 * \brief connect to TCP or AF_UNIX endpoint, then run the handshake of the validator and keep reading once it is accepted.
+		 * With shm_ring_ every frame is sent through a ShmRing passed over the socket first, the server should listen on that AF_UNIX endpoint with shm_ring_ as well
+		 */
+		void connect(const stream_endpoint& endpoint_, bool shm_ring_ = false) noexcept
+		{
+			asio::co_spawn(m_socket.get_executor(), run(endpoint_, shm_ring_), asio::detached);
+		}
+
+		/**
+		 * \brief switch to the highest framing both sides speak, peer_version_ is the one the server put on ValidationMessage.
+		 * Should be called before the answer is sent, so the answer already goes out with the new framing
+		 */
+		void upgrade(WireVersion peer_version_) noexcept
+		{
+			const auto version = std::min(peer_version_, max_wire_version);
+			if (version > WireVersion::V1)
+				send(VersionMessage{version});
+		}
+
+		/**
+		 * \brief take the queued frames of type_ out, on the event loop once the connection dropped. Frames of the failed write are
+		 * among them, the peer may or may not have them. The next run drops whatever is still queued
+		 */
+		std::vector<shared_frame> take_unsent(MessageType type_) noexcept
+		{
+			return m_out_messages.take(type_);
 		}
 
 		socket_type& socket() noexcept { return m_socket; }
 		const socket_type& socket() const noexcept { return m_socket; }
 		bool is_connected() const noexcept { return m_socket.is_open() /*&& !m_is_closed*/; }
 
-	private:
-		void send(std::span<const u8> msg_)
+		/**
+		 * \brief connect, run the handshake and keep reading until the connection drops. Anything left from a previous connection is dropped first
+		 * \return true when the handshake was accepted
+		 */
+		asio::awaitable<bool> run(stream_endpoint endpoint_, bool shm_ring_ = false) noexcept
 		{
-			m_out_messages.emplace(msg_.begin(), msg_.end());
+			m_decoder.clear();
+			m_out_messages.clear();
+			m_on_writing = false;
+			m_write_count = 0;
+			m_send_version = WireVersion::V1;
+			m_batch = {};
+
+			asio::error_code ec;
+			co_await m_socket.async_connect(endpoint_, asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+			{
+				m_socket.close();
+				co_return false;
+			}
 
-			if (m_on_writing)
-				return;
-			m_on_writing = true;
-			asio::async_write(m_socket, asio::buffer(m_out_messages.front(), m_out_messages.front().size()), [&](const asio::error_code& ec_, size_t) { handle_write(ec_); });
+#ifdef AR_HAS_SHM_RING
+			m_ring.reset();
+			if (shm_ring_ && !co_await send_ring())
+			{
+				disconnect();
+				co_return false;
+			}
+#endif
+
+			if (!co_await m_validation_handler->handshake(*this))
+			{
+				disconnect();
+				co_return false;
+			}
+			co_await read_loop();
+			co_return true;
 		}
 
-		template<bool Continuous, bool Timed = false, bool Handle = true>
-		void read_header() noexcept
+	private:
+		/**
+		 * \brief slice the next buffered message into msg_, Batch frames are unpacked first. Version frame of the server is the last one
+		 * with the previous framing, neither of them reaches the handlers
+		 */
+		bool next_message(Message& msg_) noexcept
 		{
-			static_assert((Continuous && !Timed) || (!Continuous && Timed) || (!Continuous && !Timed), "Couldn't do continuous read with timed turned on, Timed can only be used for Non-continuous read");
-			static_assert((Continuous && Handle) || (!Continuous && (Handle || !Handle)), "Continuous read should be handled by IMessageHandler");
-
-			asio::async_read(m_socket, asio::buffer(m_header_input_buffer, Message::header_size), [&](const asio::error_code& ec_, [[maybe_unused]] size_t a)
+			while (m_batch.next(msg_) || m_decoder.next(msg_))
 			{
-				if constexpr (Timed)
+				// Only comes from the decoder, m_batch is drained first and never yields one
+				if (msg_.type() == MessageType::Batch)
 				{
-					if (m_read_once_timer->expiry() < asio::steady_timer::clock_type::now())
-						return;
+					m_batch.reset(msg_);
+					continue;
 				}
+				if (msg_.type() != MessageType::Version)
+					return true;
 
-				handle_read_header<Continuous, Handle>(ec_);
-			});
+				VersionMessage version{};
+				if (version.deserialize(msg_.body))
+					m_decoder.version(std::clamp(version.version, WireVersion::V1, max_wire_version));
+			}
+			return false;
 		}
 
-		template<bool Continuous, bool Handle>
-		void read_body() noexcept
+		/**
+		 * \brief dispatch every message until the read fails, each complete frame on a single read is dispatched before reading again
+		 */
+		asio::awaitable<void> read_loop() noexcept
 		{
-			m_header_input_buffer.fill(0);
-			m_input_message.resize_body();
-			asio::async_read(m_socket, asio::buffer(m_input_message.body, m_input_message.header.body_size), [&](const asio::error_code& ec_, [[maybe_unused]] size_t bytes_)
+			while (co_await read_message(m_input_message))
 			{
-				handle_read_body<Continuous, Handle>(ec_);
-			});
+				if (!dispatch(m_input_message))
+					break;
+				if (!is_connected())
+					co_return;
+			}
+			disconnect();
 		}
 
-		template<bool Continuous, bool Handle>
-		void handle_read_header(const asio::error_code& ec_)
+		/**
+		 * \brief hand msg_ to the message handler, stream chunks are handed one by one as well
+		 * \return false when the message is malformed
+		 */
+		bool dispatch(const Message& msg_) noexcept
 		{
-			if (ec_)
+			if (msg_.type() != MessageType::Stream)
 			{
-				// socket closed
-				if (is_disconnect_error(ec_))
+				m_message_handler->on_new_in_message(*this, msg_);
+				return true;
+			}
+
+			StreamChunk chunk{};
+			if (!chunk.deserialize(msg_.body))
+				return false;
+			m_message_handler->on_new_in_stream(*this, chunk);
+			return true;
+		}
+
+		void on_deadline() noexcept
+		{
+			spdlog::warn("Timed out waiting for message");
+			m_read_cancel.emit(asio::cancellation_type::terminal);
+		}
+
+		/**
+		 * \brief gather every queued frame (bounded by ConnectionConfig) into a single write
+		 */
+		void write_pending() noexcept
+		{
+			usize bytes = 0;
+			m_write_count = 0;
+			m_write_buffers.clear();
+			m_write_batches.clear();
+			for (auto it = m_out_messages.begin(); it != m_out_messages.end();)
+			{
+				// Run of small frames goes out as a single Batch frame
+				const auto count = m_send_version >= WireVersion::V2 && m_config.batch_max_body
+					? m_out_messages.batch_length(it, m_config.batch_max_body, m_config.max_write_bytes) : 1;
+				const auto& msg = count > 1 ? m_write_batches.emplace_back(make_batch_frame(it, it + static_cast<isize>(count))) : *it;
+
+				const auto header = msg->header(m_send_version);
+				const auto size = header.size() + msg->body().size();
+				// V1 frame goes out as one buffer, V2 as its header and its body
+				const usize buffers = m_send_version == WireVersion::V1 ? 1 : 2;
+				// Always take the first frame, even when it is bigger than the caps
+				if (m_write_count && (m_write_buffers.size() + buffers > m_config.max_write_buffers || bytes + size > m_config.max_write_bytes))
+					break;
+
+				if (m_send_version == WireVersion::V1)
+					m_write_buffers.emplace_back(msg->data(), msg->size());
+				else
 				{
-					disconnect();
-					return;
+					m_write_buffers.emplace_back(header.data(), header.size());
+					m_write_buffers.emplace_back(msg->body().data(), msg->body().size());
+					wire_counters().count(msg->type(), header.size());
 				}
+				bytes += size;
+				m_write_count += count;
+				it += static_cast<isize>(count);
 
-				if constexpr (Continuous)
-					read_header<true>();
-				return;
+				// Frames are framed in the order they go out, so every frame behind the Version frame takes its version
+				if (msg->type() == MessageType::Version)
+					m_send_version = static_cast<WireVersion>(msg->body()[0]);
 			}
-			if (!m_input_message.parse_header(m_header_input_buffer))
+
+			m_on_writing = true;
+#ifdef AR_HAS_SHM_RING
+			if (m_ring)
 			{
-				if constexpr (Continuous)
-					read_header<true>();
+				asio::co_spawn(m_socket.get_executor(), write_ring(), asio::detached);
 				return;
 			}
-			read_body<Continuous, Handle>();
+#endif
+			asio::async_write(m_socket, m_write_buffers, [&](const asio::error_code& ec_, size_t) { handle_write(ec_); });
 		}
 
-		template<bool Continuous, bool Handle>
-		void handle_read_body(const asio::error_code& ec_)
+#ifdef AR_HAS_SHM_RING
+		asio::awaitable<bool> send_ring() noexcept
 		{
-			if (ec_)
-			{
-				// socket closed
-				if (is_disconnect_error(ec_))
-					disconnect();
-			}
-			else
-			{
-				m_read_once_timer->cancel();	// Cancel on here, so when on handle_message calls another read_once or read_timed it will not bother the new handler
-												// Or maybe better to post it on asio event loop function on handle_message
+			m_ring = ShmRing::create(m_socket.get_executor(), m_config.shm_ring_capacity);
+			if (!m_ring)
+				co_return false;
 
-				if constexpr (Handle)
-					handle_message();
-			}
-
-			if constexpr (Continuous)
-				read_header<true>();
+			asio::error_code ec;
+			co_await m_socket.async_wait(asio::socket_base::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+			co_return !ec && m_ring->send_to(m_socket.native_handle());
 		}
 
-		void handle_message() noexcept
+		/**
+		 * \brief copy the gathered frames into the ring, sleeping on its eventfd only while it is full
+		 */
+		asio::awaitable<void> write_ring() noexcept
 		{
-			if (m_input_message.type() == MessageType::Validation)
-				m_validation_handler->validate(*this, m_input_message);
-			else
-				m_message_handler->on_new_in_message(*this, m_input_message);
+			asio::error_code ec;
+			for (const auto& buffer : m_write_buffers)
+			{
+				std::span data{ static_cast<const u8*>(buffer.data()), buffer.size() };
+				while (!data.empty() && !ec)
+				{
+					data = data.subspan(m_ring->write(data));
+					if (!data.empty())
+						ec = co_await m_ring->wait_writable({});
+				}
+			}
+			handle_write(ec);
 		}
+#endif
 
 		void handle_write(const asio::error_code& ec_)
 		{
 			if (ec_)
 			{
-				// socket closed
-				if (is_disconnect_error(ec_))
-					disconnect();
-
+				// Queue is stuck behind the failed write otherwise, nothing would be written again. The reconnect starts over
+				disconnect();
 				return;
 			}
 
-			m_message_handler->on_new_out_message(*this, m_out_messages.front());
+			for (; m_write_count; --m_write_count)
+			{
+				m_message_handler->on_new_out_message(*this, m_out_messages.front()->bytes());
+				m_out_messages.pop_front();
+			}
 
-			m_out_messages.pop();
 			if (m_out_messages.empty())
 			{
 				m_on_writing = false;
+				m_flush_signal.cancel();
 				return;
 			}
 
-			asio::async_write(m_socket, asio::buffer(m_out_messages.front(), m_out_messages.front().size()), [&](const asio::error_code& ec_, size_t) { handle_write(ec_); });
+			write_pending();
 		}
 
 	private:
 		bool m_on_writing;
 		// bool m_is_closed;
+		ConnectionConfig m_config;
+		usize m_write_count;	// Frames owned by the in-flight write
+		WireVersion m_send_version{WireVersion::V1};	// Framing of the next gathered frame
 
-		std::unique_ptr<asio::steady_timer> m_read_once_timer;
+		WheelTimer m_deadline;		// Armed only by timed read_message, cancels the pending read through m_read_cancel
+		asio::cancellation_signal m_read_cancel;
+		asio::steady_timer m_flush_signal;	// Never expires, cancelled to wake flush once the queue is flushed
+		StreamChunk::id_type m_last_stream_id{};
 
 		ref<message_handler_type> m_message_handler;
 		ref<IConnectionValidator<ConnectionType::Client>> m_validation_handler;
 
-		std::array<u8, Message::header_size> m_header_input_buffer;
-		std::queue<std::vector<u8>> m_out_messages;
+		FrameDecoder m_decoder;
+		OutboundQueue m_out_messages;	// Frame is released once the write that carries it completes
+		std::vector<asio::const_buffer> m_write_buffers;
+		std::vector<shared_frame> m_write_batches;	// Batch frames built by the in-flight write
 		Message m_input_message;
+		BatchReader m_batch;	// Rest of the last received Batch frame
+#ifdef AR_HAS_SHM_RING
+		std::optional<ShmRing> m_ring;	// Frames go through it instead of the socket, the socket still carries frames of the server
+#endif
 		socket_type m_socket;
 	};
 
@@ -0,0 +1,61 @@
+#pragma once
+#include <chrono>
+
+#include "util/types.h"
+
+namespace ar
+{
+	enum class SlowConsumerPolicy : u8
+	{
+		DropPresence,	// Drop the oldest queued NewUser and UserDisconnect frames
+		Coalesce,		// Remove queued NewUser and UserDisconnect pairs of the same user
+		Disconnect,		// Close the connection right away
+	};
+
+	struct ConnectionConfig
+	{
+		// Upper bound of bytes flushed by a single gather write, frames that don't fit will be written on the next wakeup
+		usize max_write_bytes = 64 * 1024;
+		// Upper bound of buffers on a single gather write, asio only passes 64 buffers into one writev call anyway
+		usize max_write_buffers = 64;
+		// Initial size of the receive buffer, every complete frame on a single read is dispatched before reading again
+		usize read_buffer_size = 16 * 1024;
+		// Frame (header + body) bigger than this closes the connection before any of its body is buffered.
+		// Bigger bodies should be sent with async_send_stream
+		usize max_frame_size = 1024 * 1024;
+		// Data bytes on each chunk of async_send_stream, should be less than max_frame_size of the peer
+		usize stream_chunk_size = 64 * 1024;
+		// Queued frames with a body up to this size go out packed in one Batch frame with the small frames next to them, zero disables it.
+		// Only on connections that negotiated WireVersion::V2
+		usize batch_max_body = 256;
+
+		// Outbound queue above either high watermark triggers slow_consumer_policy, the connection is closed when the policy can't bring it back
+		usize high_watermark_bytes = 4 * 1024 * 1024;
+		usize high_watermark_frames = 4096;
+		// DropPresence keeps dropping until the queue is below both low watermarks
+		usize low_watermark_bytes = 1024 * 1024;
+		usize low_watermark_frames = 1024;
+		SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::Coalesce;
+
+		// Server closes a connection that sent nothing for this long after the handshake, zero disables it.
+		// Chat users can stay silent for hours, so it is only meant for deployments where clients send heartbeats
+		std::chrono::seconds idle_timeout{ 0 };
+
+		// Receive slots of read_buffer_size registered on the io_uring of each server event loop, only used when built with CHATTY_USE_IO_URING.
+		// Connections beyond it read into their own buffer
+		usize registered_receive_slots = 1024;
+		// Buffers shared by the multishot receives of every connection on a server event loop, connections use registered_receive_slots when it isn't available.
+		// Only used when built with CHATTY_USE_IO_URING on Linux 6.0 or newer, a power of two up to 32768 or zero to disable it
+		usize multishot_receive_buffers = 512;
+		usize multishot_buffer_size = 4 * 1024;
+
+		// Size of the shared memory ring a client creates for the frames it sends, servers refuse bigger rings.
+		// Only used on AF_UNIX connections that opt in to the ring
+		usize shm_ring_capacity = 4 * 1024 * 1024;
+
+		// Client reconnects after a dropped connection with jittered exponential backoff from reconnect_delay up to reconnect_max_delay.
+		// Zero reconnect_delay disables it
+		std::chrono::milliseconds reconnect_delay{ 0 };
+		std::chrono::milliseconds reconnect_max_delay{ 30'000 };
+	};
+}
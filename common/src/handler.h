@@ -1,6 +1,11 @@
 ﻿#pragma once
+#include <memory>
+#include <asio/awaitable.hpp>
+
 #include "connection_status.h"
+#include "connection_config.h"
 #include "util/pointer.h"
+#include "util/asio.h"
 
 namespace ar
 {
@@ -8,6 +13,7 @@ namespace ar
 	class Connection;
 	
 	struct Message;
+	struct StreamChunk;
 	
 	template<ConnectionType Owner>
 	class IMessageHandler
@@ -16,6 +22,8 @@ namespace ar
 		virtual ~IMessageHandler() = default;
 		virtual void on_new_in_message(Connection<Owner>& conn_, const Message& message_) noexcept = 0;
 		virtual void on_new_out_message(Connection<Owner>& conn_, std::span<const u8> message_) noexcept = 0;
+		// Chunks of a stream come in order, each one only once and not reassembled. Handler that doesn't expect streams just ignores them
+		virtual void on_new_in_stream([[maybe_unused]] Connection<Owner>& conn_, [[maybe_unused]] const StreamChunk& chunk_) noexcept {}
 	};
 
 
@@ -25,23 +33,28 @@ namespace ar
 	public:
 		virtual ~IConnectionValidator() = default;
 
-		// Send challenge
-		virtual void start_validation(Connection<Owner>& conn_) noexcept = 0;
-		// Retrieve answer and send 0 or 1
-		virtual void validate(Connection<Owner>& conn_, const Message& msg_) noexcept = 0;
+		/**
+		 * \brief whole handshake of a new connection, runs on the event loop that owns the connection
+		 * \return false when the connection is rejected, the connection only starts reading when it is accepted
+		 */
+		virtual asio::awaitable<bool> handshake(Connection<Owner>& conn_) noexcept = 0;
 	};
 	
 	class IConnectionHandler : public IConnectionValidator<ConnectionType::Server>
 	{
 	public:
 		using connection_type = Connection<ConnectionType::Server>;
-		using connection_ptr = std::add_pointer_t<connection_type>;
+		// Connection is freed once it is removed and the last operation holding it completes
+		using connection_ptr = std::shared_ptr<connection_type>;
 
-		virtual connection_ptr add_connection(asio::ip::tcp::socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_) noexcept = 0;
+		virtual connection_ptr add_connection(stream_socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_, const ConnectionConfig& config_) noexcept = 0;
 		virtual void remove_connection(connection_type& conn_) noexcept = 0;
 
-		virtual std::span<connection_ptr> connections() noexcept = 0;
+		// Snapshot of current connections, connections can be added or removed by other event loops meanwhile
+		virtual std::vector<connection_ptr> connections() noexcept = 0;
 		virtual connection_ptr connection(u32 id_) noexcept = 0;
+		// Drop every connection without announcing it, event loops should be stopped already
+		virtual void clear_connections() noexcept = 0;
 	};
 
 	template<typename T, ConnectionType Owner>
@@ -55,7 +68,6 @@ namespace ar
 	class EmptyValidator : public IConnectionValidator<Owner>
 	{
 	public:
-		void start_validation(Connection<Owner>& conn_) noexcept override {}
-		void validate(Connection<Owner>& conn_, const Message& msg_) noexcept override {}
+		asio::awaitable<bool> handshake(Connection<Owner>& conn_) noexcept override { co_return true; }
 	};
 }
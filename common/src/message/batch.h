@@ -0,0 +1,102 @@
+#pragma once
+#include <cstring>
+#include <iterator>
+#include <span>
+
+#include "message.h"
+#include "frame.h"
+#include "wire.h"
+#include "util/types.h"
+
+namespace ar
+{
+	// Payload: $@...$@...
+	// $: type of the sub message
+	// @: body size of the sub message as varint
+	// ...: body of the sub message
+	/*
+	 * Batch carries several small messages in one frame, each with the V2 header in front of it. Connection packs runs of small queued
+	 * frames into it on its own and unpacks it before anything is handed to the handlers, so neither side ever builds one by hand.
+	 * Only sent on connections that negotiated V2, both came in together
+	 */
+
+	inline bool is_batchable(const Frame& frame_, usize max_body_) noexcept
+	{
+		const auto type = frame_.type();
+		// Version switches the framing of whatever follows it
+		return frame_.body().size() <= max_body_ && type != MessageType::Version && type != MessageType::Batch;
+	}
+
+	/**
+	 * \brief Batch frame of every frame in [first_, last_), sub messages keep their order
+	 */
+	template<std::forward_iterator It>
+	shared_frame make_batch_frame(It first_, It last_)
+	{
+		usize size = 0;
+		for (auto it = first_; it != last_; ++it)
+			size += (*it)->header(WireVersion::V2).size() + (*it)->body().size();
+
+		return std::allocate_shared<const Frame>(pool_allocator<Frame>{}, MessageType::Batch, size, [&](std::span<u8> body_)
+		{
+			auto out = body_.data();
+			for (auto it = first_; it != last_; ++it)
+			{
+				const auto header = (*it)->header(WireVersion::V2);
+				const auto body = (*it)->body();
+				std::memcpy(out, header.data(), header.size());
+				std::memcpy(out + header.size(), body.data(), body.size());
+				out += header.size() + body.size();
+			}
+		});
+	}
+
+	/**
+	 * \brief slices the sub messages out of a received Batch body, the body is owned until the last one is sliced
+	 */
+	class BatchReader
+	{
+	public:
+		BatchReader() noexcept : m_offset{}
+		{
+		}
+
+		// Take the body of msg_ over, msg_ is only reused for the sub messages afterwards
+		void reset(Message& msg_) noexcept
+		{
+			m_body.swap(msg_.body);
+			m_offset = 0;
+		}
+
+		/**
+		 * \brief slice the next sub message into msg_
+		 * \return false when the batch is consumed or the rest of it is malformed, the rest is dropped then
+		 */
+		bool next(Message& msg_) noexcept
+		{
+			if (m_offset == m_body.size())
+				return false;
+
+			const auto rest = std::span<const u8>{ m_body }.subspan(m_offset);
+			const auto header = parse_frame_header(WireVersion::V2, rest);
+			// Batch is never nested
+			if (!header || !header->size || rest.size() - header->size < header->body_size || header->type == MessageType::Batch)
+			{
+				m_offset = m_body.size();
+				return false;
+			}
+
+			msg_.header = { header->type, header->body_size };
+			const auto body = rest.subspan(header->size, header->body_size);
+			msg_.body.assign(body.begin(), body.end());
+			m_offset += header->size + header->body_size;
+			return true;
+		}
+
+		[[nodiscard]] bool empty() const noexcept { return m_offset == m_body.size(); }
+
+	private:
+		byte_buffer m_body;
+		usize m_offset;
+	};
+}
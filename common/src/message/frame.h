@@ -0,0 +1,122 @@
+#pragma once
+#include <concepts>
+#include <memory>
+#include <vector>
+#include <span>
+#include <cstring>
+#include <type_traits>
+
+#include "message.h"
+#include "wire.h"
+#include "util/types.h"
+#include "util/concept.h"
+#include "util/buffer_pool.h"
+#include "util/util.h"
+
+namespace ar
+{
+	/**
+	 * \brief immutable serialized message (header + body), serialized once and shared by every outbound queue it is enqueued on
+	 */
+	class Frame
+	{
+	public:
+		explicit Frame(const Message& msg_) : m_data{msg_.serialize()}
+		{
+			make_v2_header();
+		}
+
+		Frame(MessageType type_, std::span<const u8> body_) : Frame(type_, body_, {})
+		{
+		}
+
+		// Body made of two parts, saves building the body in a temporary first
+		Frame(MessageType type_, std::span<const u8> head_, std::span<const u8> tail_) : m_data(Message::header_size + head_.size() + tail_.size())
+		{
+			const Message::Header header{type_, static_cast<u32>(head_.size() + tail_.size())};
+			std::memcpy(m_data.data(), &header, Message::header_size);
+			std::memcpy(m_data.data() + Message::header_size, head_.data(), head_.size());
+			std::memcpy(m_data.data() + Message::header_size + head_.size(), tail_.data(), tail_.size());
+			make_v2_header();
+		}
+
+		// Body written in place by write_, for a body gathered from several sources
+		template<std::invocable<std::span<u8>> Writer>
+		Frame(MessageType type_, usize body_size_, Writer&& write_) : m_data(Message::header_size + body_size_)
+		{
+			const Message::Header header{type_, static_cast<u32>(body_size_)};
+			std::memcpy(m_data.data(), &header, Message::header_size);
+			write_(std::span<u8>{ m_data }.subspan(Message::header_size));
+			make_v2_header();
+		}
+
+		// Body as received with patch_ written over it at patch_offset_, so a relayed message is copied once and never parsed
+		Frame(MessageType type_, std::span<const u8> body_, usize patch_offset_, std::span<const u8> patch_) : Frame(type_, body_)
+		{
+			std::memcpy(m_data.data() + Message::header_size + patch_offset_, patch_.data(), patch_.size());
+		}
+
+		// Whole frame framed with V1
+		[[nodiscard]] std::span<const u8> bytes() const noexcept { return m_data; }
+		[[nodiscard]] std::span<const u8> body() const noexcept { return bytes().subspan(Message::header_size); }
+
+		/**
+		 * \brief header framed with version_, body() follows it on the wire. Both headers are built once, the frame can be shared by
+		 * connections that negotiated different versions
+		 */
+		[[nodiscard]] std::span<const u8> header(WireVersion version_) const noexcept
+		{
+			if (version_ == WireVersion::V1)
+				return bytes().first(Message::header_size);
+			return { m_v2_header.data(), m_v2_header_size };
+		}
+
+		[[nodiscard]] MessageType type() const noexcept
+		{
+			Message::Header header;
+			std::memcpy(&header, m_data.data(), Message::header_size);
+			return header.id;
+		}
+
+		[[nodiscard]] const u8* data() const noexcept { return m_data.data(); }
+		[[nodiscard]] usize size() const noexcept { return m_data.size(); }
+
+	private:
+		void make_v2_header() noexcept
+		{
+			const auto body_size = static_cast<u32>(m_data.size() - Message::header_size);
+			m_v2_header[0] = static_cast<u8>(type());
+			m_v2_header_size = static_cast<u8>(sizeof(MessageType) + write_varint(body_size, m_v2_header.data() + sizeof(MessageType)));
+		}
+
+	private:
+		byte_buffer m_data;		// V1 header and the body
+		std::array<u8, max_v2_header_size> m_v2_header;
+		u8 m_v2_header_size;
+	};
+
+	using shared_frame = std::shared_ptr<const Frame>;
+
+	// Frame and its control block are allocated from the thread buffer pool as well
+	inline shared_frame make_frame(const Message& msg_)
+	{
+		return std::allocate_shared<const Frame>(pool_allocator<Frame>{}, msg_);
+	}
+
+	template<Serializable T>
+	shared_frame make_frame(const T& msg_)
+	{
+		return std::allocate_shared<const Frame>(pool_allocator<Frame>{}, msg_.type(), msg_.serialize());
+	}
+
+	/**
+	 * \brief frame of msg_ with value_ written over its body at offset_, for forwarding a message without deserializing it
+	 */
+	template<typename T> requires std::is_trivially_copyable_v<T>
+	shared_frame make_patched_frame(const Message& msg_, usize offset_, const T& value_)
+	{
+		if (msg_.body.size() < offset_ + sizeof(T))
+			return nullptr;
+		return std::allocate_shared<const Frame>(pool_allocator<Frame>{}, msg_.type(), msg_.body, offset_, to_span<u8>(value_));
+	}
+}
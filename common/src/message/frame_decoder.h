@@ -0,0 +1,169 @@
+#pragma once
+#include <vector>
+#include <span>
+#include <cstring>
+#include <limits>
+
+#include "message.h"
+#include "wire.h"
+#include "util/types.h"
+
+namespace ar
+{
+	/**
+	 * \brief streaming receive buffer, socket reads are appended on it and every complete frame is sliced out, partial frame is carried over to the next read
+	 */
+	class FrameDecoder
+	{
+	public:
+		FrameDecoder(usize capacity_, usize max_frame_size_) : m_owned(capacity_), m_buffer{m_owned}, m_begin{}, m_end{}, m_max_frame_size{max_frame_size_},
+			m_version{WireVersion::V1}
+		{
+		}
+
+		// m_buffer points into m_owned, moving the vector keeps its storage
+		FrameDecoder(const FrameDecoder& other) = delete;
+		FrameDecoder& operator=(const FrameDecoder& other) = delete;
+		FrameDecoder(FrameDecoder&& other) noexcept = default;
+		FrameDecoder& operator=(FrameDecoder&& other) noexcept = default;
+
+		/**
+		 * \brief receive into storage_ owned by somebody else (registered buffer), the decoder falls back to its own storage when a frame doesn't fit
+		 */
+		void attach(std::span<u8> storage_) noexcept
+		{
+			if (storage_.size() < available())
+				return;
+			std::memmove(storage_.data(), m_buffer.data() + m_begin, available());
+			m_end -= m_begin;
+			m_begin = 0;
+			m_buffer = storage_;
+			m_owned = {};
+		}
+
+		/**
+		 * \brief move the pending bytes back to the decoder own storage, the attached storage is no longer touched after this call
+		 */
+		void detach() noexcept
+		{
+			if (!is_attached())
+				return;
+			grow(m_buffer.size());
+		}
+
+		[[nodiscard]] bool is_attached() const noexcept { return m_buffer.data() != m_owned.data(); }
+
+		/**
+		 * \brief writable region for the next socket read, compact or grow the buffer when the pending frame doesn't fit
+		 */
+		std::span<u8> prepare() noexcept
+		{
+			if (m_begin == m_end)
+				m_begin = m_end = 0;
+
+			const usize needed = pending_size();
+			if (m_buffer.size() - m_begin < needed || m_end == m_buffer.size())
+			{
+				std::memmove(m_buffer.data(), m_buffer.data() + m_begin, available());
+				m_end -= m_begin;
+				m_begin = 0;
+			}
+			if (m_buffer.size() < needed)
+				grow(needed);
+
+			return { m_buffer.data() + m_end, m_buffer.size() - m_end };
+		}
+
+		void commit(usize bytes_) noexcept
+		{
+			m_end += bytes_;
+		}
+
+		// Drop every buffered byte, for a new connection on the same decoder
+		void clear() noexcept
+		{
+			m_begin = m_end = 0;
+			m_version = WireVersion::V1;
+		}
+
+		/**
+		 * \brief framing of every frame after the one sliced last, frames that are already buffered are only parsed when they are sliced
+		 */
+		void version(WireVersion version_) noexcept { m_version = version_; }
+		[[nodiscard]] WireVersion version() const noexcept { return m_version; }
+
+		/**
+		 * \brief slice the next complete frame into msg_
+		 * \return false when there is no complete frame buffered
+		 */
+		bool next(Message& msg_) noexcept
+		{
+			const auto header = parse_frame_header(m_version, readable());
+			if (!header || !header->size || available() < header->size + header->body_size)
+				return false;
+
+			msg_.header = { header->type, header->body_size };
+			const auto begin = m_buffer.begin() + static_cast<isize>(m_begin + header->size);
+			msg_.body.assign(begin, begin + header->body_size);
+			m_begin += header->size + header->body_size;
+			return true;
+		}
+
+		[[nodiscard]] bool has_frame() const noexcept
+		{
+			const auto header = parse_frame_header(m_version, readable());
+			return header && header->size && available() >= header->size + header->body_size;
+		}
+
+		[[nodiscard]] usize available() const noexcept { return m_end - m_begin; }
+
+		// Header of the pending frame claims more than max frame size or is malformed, the buffer is never grown for it
+		[[nodiscard]] bool is_oversized() const noexcept
+		{
+			return pending_size() > m_max_frame_size;
+		}
+
+	private:
+		void grow(usize size_) noexcept
+		{
+			if (!is_attached())
+			{
+				m_owned.resize(size_);
+				m_buffer = m_owned;
+				return;
+			}
+
+			std::vector<u8> owned(size_);
+			std::memcpy(owned.data(), m_buffer.data() + m_begin, available());
+			m_end -= m_begin;
+			m_begin = 0;
+			m_owned = std::move(owned);
+			m_buffer = m_owned;
+		}
+
+		std::span<const u8> readable() const noexcept
+		{
+			return { m_buffer.data() + m_begin, available() };
+		}
+
+		// Bytes needed to complete the frame at the front of the buffer
+		usize pending_size() const noexcept
+		{
+			const auto header = parse_frame_header(m_version, readable());
+			// V2 header is complete once its varint ends, one more byte at a time
+			if (!header)
+				return m_version == WireVersion::V1 ? Message::header_size : available() + 1;
+			if (!header->size)
+				return std::numeric_limits<usize>::max();
+			return header->size + header->body_size;
+		}
+
+	private:
+		std::vector<u8> m_owned;
+		std::span<u8> m_buffer;		// Either m_owned or the attached storage
+		usize m_begin;
+		usize m_end;
+		usize m_max_frame_size;
+		WireVersion m_version;
+	};
+}
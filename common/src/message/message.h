@@ -1,14 +1,18 @@
 ﻿#pragma once
+#include <array>
 #include <vector>
 
 #include "util/types.h"
+#include "util/buffer_pool.h"
 #include <span>
 
 #include <fmt/ranges.h>
 
 #include "util/util.h"
+#include "util/session_cipher.h"
 #include "util/concept.h"
 #include "util/literal.h"
+#include "schema.h"
 
 namespace ar
 {
@@ -23,8 +27,23 @@ namespace ar
 		UserDisconnect,		// Used when some user is disconnected
 		NewUser,			// Used when some user is connected
 		Close,				// Client wanted to close the Connection
+		Stream,				// Chunk of a body bigger than a single frame, see StreamChunk
+		Handshake,			// Validation and authentication in a single frame
+		Session,			// Resumption token issued after authentication
+		Resume,				// Validation and resumption of a previous session
+		Version,			// Framing of every following frame in this direction, see message/wire.h
+		Batch,				// Several small messages in one frame, see message/batch.h
 	};
 
+	// Framing of the frame header, see message/wire.h
+	enum class WireVersion : u8
+	{
+		V1 = 1,
+		V2 = 2,
+	};
+
+	static inline constexpr WireVersion max_wire_version = WireVersion::V2;
+
 	enum class CommandType : u8
 	{
 		OnlineList,
@@ -40,7 +59,7 @@ namespace ar
 			u32 body_size;
 		} header;
 
-		std::vector<u8> body;
+		byte_buffer body;
 
 		static inline constexpr usize header_size = sizeof(Header);
 
@@ -95,9 +114,9 @@ namespace ar
 			return body.size() + header_size;
 		}
 
-		std::vector<u8> serialize() const noexcept
+		byte_buffer serialize() const noexcept
 		{
-			std::vector<u8> result{(sizeof(header) + body.size()), std::allocator<u8>{}};
+			byte_buffer result(sizeof(header) + body.size());
 			std::memcpy(result.data(), &header, sizeof(header));
 			std::memcpy(result.data() + sizeof(header), body.data(), body.size());
 			return result;
@@ -131,31 +150,35 @@ namespace ar
 			t.deserialize(body);
 			return t;
 		}
+
+		/**
+		 * \brief non-owning T (see message/view.h) over the body, only valid while this message is neither modified nor destroyed
+		 * \return std::nullopt when the body is malformed
+		 */
+		template<Deserializable T>
+		std::optional<T> view_as() const noexcept
+		{
+			T t{};
+			if (!t.deserialize(body))
+				return std::nullopt;
+			return t;
+		}
 	};
 
 
 	struct ValidationMessage {
 		u64 challenge;
+		WireVersion wire_version = WireVersion::V1;	// Highest framing the sender speaks, older peers neither send nor read it
 
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			auto span = to_span<u8>(challenge);
-			return {span.begin(), span.end()};
-		}
+		using schema = Schema<field<&ValidationMessage::challenge>, trailer<&ValidationMessage::wire_version>>;
 
-		[[nodiscard]] MessageType type() const noexcept { return MessageType::Validation; }
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
-		[[nodiscard]] constexpr usize size() const noexcept { return sizeof(u64); }
+		[[nodiscard]] MessageType type() const noexcept { return MessageType::Validation; }
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < sizeof(u64))
-				return false;
+		[[nodiscard]] constexpr usize size() const noexcept { return schema::size(*this); }
 
-			const auto temp = reinterpret_cast<const u64*>(body_.data());
-			challenge = *temp;
-			return true;
-		}
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 	};
 
 	// Payload: ##$...@...
@@ -168,39 +191,38 @@ namespace ar
 		std::string username{};
 		public_key_type public_key;
 
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			const auto size = static_cast<u16>(username.size());
-			const auto size_span = to_span<u8>(size);
+		using schema = Schema<prefixed<&AuthenticateMessage::username>, tail<&AuthenticateMessage::public_key>>;
 
-			std::vector<u8> result{};
-			result.insert(result.end(), size_span.begin(), size_span.end());		// Length
-			result.insert(result.end(), username.begin(), username.end());		// Username
-			result.insert(result.end(), public_key.begin(), public_key.end());	// Public Key
-
-			return result;
-		}
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::Authenticate;}
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.empty())
-				return false;
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-			const auto username_len = span_to<u16>(body_);
-			if (!username_len)
-				return false;
+		usize size() const noexcept { return schema::size(*this); }
+	};
 
-			const auto uname = shrink_span(body_, sizeof(u16), *username_len);
-			username.assign(uname.begin(), uname.end());
+	// Payload: ########...
+	// #: answer of the challenge
+	// ...: AuthenticateMessage payload
+	/**
+	 * \brief answer of the challenge pipelined with the authentication, for clients that know their username before the challenge comes.
+	 * The server replies once with the authentication feedback followed by the online list
+	 */
+	struct HandshakeMessage
+	{
+		u64 challenge;
+		AuthenticateMessage authenticate;
 
-			const auto pk = shrink_span(body_, sizeof(u16) + *username_len);
-			public_key.assign(pk.begin(), pk.end());
-			return true;
-		}
+		using schema = Schema<field<&HandshakeMessage::challenge>, nested<&HandshakeMessage::authenticate>>;
+
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
+
+		[[nodiscard]] MessageType type() const noexcept { return MessageType::Handshake; }
 
-		constexpr usize size() const noexcept { return username.size() + public_key.size(); }
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
+
+		usize size() const noexcept { return schema::size(*this); }
 	};
 
 	enum class FeedbackType : u8
@@ -210,29 +232,68 @@ namespace ar
 		Undefined /*= 0*/,
 		AuthenticationSucceed,
 		ValidationSucceed,
+		ResumeFailed,		// Session is gone, the client should authenticate instead
 	};
 
 	struct FeedbackMessage
 	{
 		FeedbackType data;
 
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			return {{static_cast<u8>(this->data)}};
-		}
+		using schema = Schema<field<&FeedbackMessage::data>>;
+
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::Feedback; }
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < sizeof(u8))
-				return false;
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-			data = static_cast<FeedbackType>(body_[0]);
-			return true;
-		}
+		constexpr usize size() const noexcept { return schema::size(*this); }
+	};
+
+	// Payload: ####$$$$$$$$$$$$$$$$
+	// #: id of the user
+	// $: token
+	/**
+	 * \brief issued by the server after authentication, a client that reconnects within the grace period presents it on ResumeMessage
+	 * to get the same id, username and public key back. Tokens are single use, every resumption issues a new one
+	 */
+	struct SessionMessage
+	{
+		using id_type = u32;
+		using token_type = std::array<u8, 16>;
+
+		id_type id;
+		token_type token;
+
+		using schema = Schema<field<&SessionMessage::id>, field<&SessionMessage::token>>;
+
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
+
+		[[nodiscard]] MessageType type() const noexcept { return MessageType::Session; }
+
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
+
+		constexpr usize size() const noexcept { return schema::size(*this); }
+	};
+
+	// Payload: ########....$$$$$$$$$$$$$$$$
+	// #: answer of the challenge
+	// .: id of the session
+	// $: token
+	struct ResumeMessage
+	{
+		u64 challenge;
+		SessionMessage session;
+
+		using schema = Schema<field<&ResumeMessage::challenge>, nested<&ResumeMessage::session>>;
+
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
+
+		[[nodiscard]] MessageType type() const noexcept { return MessageType::Resume; }
 
-		constexpr usize size() const noexcept { return sizeof(FeedbackType); }
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
+
+		constexpr usize size() const noexcept { return schema::size(*this); }
 	};
 
 	enum class ChatOpponent : u8
@@ -247,7 +308,9 @@ namespace ar
 
 		ChatOpponent opponent;
 		id_type opponent_id;
-		std::vector<u8> message;
+		byte_buffer message;
+
+		using schema = Schema<field<&ChatMessage::opponent>, field<&ChatMessage::opponent_id>, tail<&ChatMessage::message>>;
 
 		static ChatMessage for_server(std::string_view message_) noexcept
 		{
@@ -259,63 +322,42 @@ namespace ar
 			return ChatMessage{ ChatOpponent::User, id_, {message_.begin(), message_.end() }};
 		}
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < sizeof(u32))
-				return false;
-
-			const auto dest_type = span_to<u8>(body_);
-			if (!dest_type)
-				return false;
-			const auto id = span_to<const u32>(body_, sizeof(ChatOpponent));
-			if (!id)
-				return false;
-			opponent = static_cast<ChatOpponent>(*dest_type);
-			opponent_id = *id;
-			message.assign(body_.begin() + sizeof(ChatOpponent) + sizeof(u32), body_.end());
-			return true;
-		}
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			const usize len = message.size() + sizeof(opponent_id) + sizeof(ChatOpponent);
-			const auto span = to_span<u8>(opponent_id);
-
-			std::vector<u8> result{};
-			result.reserve(len);
-			result.emplace_back(static_cast<u8>(opponent));
-			result.insert(result.end(), span.begin(), span.end());
-			result.insert(result.end(), message.begin(), message.end());
-			return result;
-		}
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::Chat; }
 
-		[[nodiscard]] constexpr usize size() const noexcept
-		{
-			return sizeof(ChatOpponent) + sizeof(opponent_id) + message.size();
-		}
+		[[nodiscard]] usize size() const noexcept { return schema::size(*this); }
 
 		[[nodiscard]] constexpr std::string message_str() const noexcept
 		{
 			return std::string{ message.begin(), message.end() };
 		}
 
-		void encrypt(cry::RandomNumberGenerator& rng_, const cry::ElGamal::PublicKey& public_key_) noexcept
+		// Sealed with the session key of opponent_id, encryptor_ of the opponent only wraps that key the first time
+		void encrypt(cry::RandomNumberGenerator& rng_, SessionCipher& cipher_, const cry::ElGamal::Encryptor& encryptor_) noexcept
 		{
-			const cry::ElGamal::Encryptor enc{public_key_};
-			auto res = ::ar::encrypt(rng_, enc, message);
-			message = std::move(res);
+			message = cipher_.seal(rng_, opponent_id, encryptor_, message);
 		}
 
-		void decrypt(cry::RandomNumberGenerator& rng_, const cry::ElGamal::PrivateKey& private_key_) noexcept
+		/**
+		 * \brief open message sealed by opponent_id
+		 * \return false when it can't be opened, message is left sealed then
+		 */
+		bool decrypt(cry::RandomNumberGenerator& rng_, SessionCipher& cipher_, const cry::ElGamal::Decryptor& decryptor_) noexcept
 		{
-			const cry::ElGamal::Decryptor dec{private_key_};
-			auto result = ::ar::decrypt(rng_, dec, message);
-			message = std::move(result);
+			auto plain = cipher_.open(rng_, opponent_id, decryptor_, message);
+			if (!plain)
+				return false;
+			message = std::move(*plain);
+			return true;
 		}
 	};
 
+	// Payload: +####...
+	// +: command type
+	// #: u32 arguments up to the end of the body
 	struct CommandMessage
 	{
 		using parameter_type = u32;
@@ -324,30 +366,15 @@ namespace ar
 		CommandType command_type;
 		command_arguments arguments;
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < size())
-				return false;
-
-			command_type = static_cast<CommandType>(body_[0]);
-			arguments.assign(body_.begin() + sizeof(CommandType), body_.end());
-			return true;
-		}
+		using schema = Schema<field<&CommandMessage::command_type>, tail<&CommandMessage::arguments>>;
 
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			const usize len = size();
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-			std::vector<u8> result{};
-			result.reserve(len);
-			result.emplace_back(static_cast<u8>(command_type));
-			result.insert(result.end(), arguments.begin(), arguments.end());	// TODO: arguments is u32 instead of u8
-			return result;
-		}
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::Command; }
 
-		[[nodiscard]] constexpr usize size() const noexcept { return arguments.size() * sizeof(parameter_type) + sizeof(CommandType); }
+		[[nodiscard]] usize size() const noexcept { return schema::size(*this); }
 	};
 
 	struct UserDisconnectMessage
@@ -356,32 +383,15 @@ namespace ar
 
 		id_type id;
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < size())
-				return false;
+		using schema = Schema<field<&UserDisconnectMessage::id>>;
 
-			const auto id_span = span_to<u32>(body_);
-			if (!id_span)
-				return false;
-
-			id = *id_span;
-			return true;
-		}
-
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			const auto id_span = to_span<u8>(id);
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-			std::vector<u8> result{};
-			result.reserve(size());
-			result.insert(result.end(), id_span.begin(), id_span.end());
-			return result;
-		}
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::UserDisconnect; }
 
-		[[nodiscard]] constexpr usize size() const noexcept { return sizeof(id_type); }
+		[[nodiscard]] constexpr usize size() const noexcept { return schema::size(*this); }
 	};
 
 	struct NewUserMessage
@@ -391,35 +401,14 @@ namespace ar
 		id_type id;
 		std::string name;
 
-		bool deserialize(std::span<const u8> body_) noexcept
-		{
-			if (body_.size() < size())
-				return false;
+		using schema = Schema<field<&NewUserMessage::id>, tail<&NewUserMessage::name>>;
 
-			const auto id_span = span_to<id_type>(body_);
-			if (!id_span)
-				return false;
-
-			id = *id_span;
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
 
-			auto name_span = shrink_span(body_, sizeof(id_type));
-			name.assign(name_span.begin(), name_span.end());
-			return true;
-		}
-
-		[[nodiscard]] std::vector<u8> serialize() const noexcept
-		{
-			const auto id_span = to_span<u8>(id);
-
-			std::vector<u8> result{};
-			result.reserve(size());
-			result.insert(result.end(), id_span.begin(), id_span.end());
-			result.insert(result.end(), name.begin(), name.end());
-			return result;
-		}
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
 
 		[[nodiscard]] MessageType type() const noexcept { return MessageType::NewUser; }
 
-		[[nodiscard]] constexpr usize size() const noexcept { return sizeof(id_type) + name.size(); }
+		[[nodiscard]] usize size() const noexcept { return schema::size(*this); }
 	};
 }
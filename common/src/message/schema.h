@@ -0,0 +1,370 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <type_traits>
+
+#include "util/types.h"
+#include "util/buffer_pool.h"
+
+namespace ar
+{
+	/*
+	 * Layout of a message body declared once as a list of fields, encode/decode/size are generated from it:
+	 *
+	 *	struct NewUserMessage
+	 *	{
+	 *		u32 id;
+	 *		std::string name;
+	 *
+	 *		using schema = Schema<field<&NewUserMessage::id>, tail<&NewUserMessage::name>>;
+	 *	};
+	 *
+	 * field	trivially copyable member, copied as it is
+	 * prefixed	string or byte vector preceded by its length
+	 * tail		string or vector of trivially copyable elements, takes every remaining byte so it can only be the last field
+	 * trailer	trivially copyable member appended to an existing layout, keeps its default when an older peer doesn't send it
+	 * nested	member that declares a schema of its own, encoded inline
+	 * list		vector preceded by its element count, each element encoded with the given fields
+	 *
+	 * Serializing allocates once with the exact size, a schema made only of fixed size fields has a constexpr size and is encoded
+	 * with constant size memcpy. Deserializing checks every bound and fails instead of reading past the body
+	 */
+
+	namespace detail
+	{
+		template<typename>
+		struct member_traits;
+
+		template<typename C, typename M>
+		struct member_traits<M C::*>
+		{
+			using class_type = C;
+			using member_type = M;
+		};
+
+		template<auto Member>
+		using member_t = typename member_traits<decltype(Member)>::member_type;
+
+		// std::string or std::vector, anything contiguous with assign() and trivially copyable elements
+		template<typename T>
+		concept byte_range = requires(T t, const typename T::value_type* p)
+		{
+			{ t.data() } -> std::convertible_to<const typename T::value_type*>;
+			{ t.size() } -> std::convertible_to<usize>;
+			t.assign(p, p);
+		} && std::is_trivially_copyable_v<typename T::value_type>;
+
+		template<byte_range T>
+		inline usize range_bytes(const T& range_) noexcept
+		{
+			return range_.size() * sizeof(typename T::value_type);
+		}
+
+		template<byte_range T>
+		inline bool read_range(T& range_, std::span<const u8> bytes_) noexcept
+		{
+			using value_type = typename T::value_type;
+			if (bytes_.size() % sizeof(value_type))
+				return false;
+
+			if constexpr (sizeof(value_type) == 1)
+			{
+				const auto begin = reinterpret_cast<const value_type*>(bytes_.data());
+				range_.assign(begin, begin + bytes_.size());
+			}
+			else
+			{
+				// Body has no alignment guarantee
+				range_.resize(bytes_.size() / sizeof(value_type));
+				std::memcpy(range_.data(), bytes_.data(), bytes_.size());
+			}
+			return true;
+		}
+	}
+
+	template<auto Member>
+	struct field
+	{
+		using value_type = detail::member_t<Member>;
+		static_assert(std::is_trivially_copyable_v<value_type>, "field needs a trivially copyable member, see prefixed/tail/nested");
+
+		static inline constexpr bool is_fixed = true;
+		static inline constexpr bool is_tail = false;
+		static inline constexpr usize fixed_size = sizeof(value_type);
+
+		template<typename T>
+		static constexpr usize size(const T&) noexcept { return fixed_size; }
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept
+		{
+			std::memcpy(out_, &(msg_.*Member), fixed_size);
+			return out_ + fixed_size;
+		}
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			if (in_.size() < fixed_size)
+				return false;
+			std::memcpy(&(msg_.*Member), in_.data(), fixed_size);
+			in_ = in_.subspan(fixed_size);
+			return true;
+		}
+	};
+
+	// Longer ranges than Length can hold are cut, size() accounts for it
+	template<auto Member, std::unsigned_integral Length = u16>
+	struct prefixed
+	{
+		using value_type = detail::member_t<Member>;
+		static_assert(detail::byte_range<value_type>);
+
+		static inline constexpr bool is_fixed = false;
+		static inline constexpr bool is_tail = false;
+		static inline constexpr usize fixed_size = sizeof(Length);
+
+		template<typename T>
+		static usize count(const T& msg_) noexcept
+		{
+			return std::min<usize>((msg_.*Member).size(), std::numeric_limits<Length>::max());
+		}
+
+		template<typename T>
+		static usize size(const T& msg_) noexcept
+		{
+			return sizeof(Length) + count(msg_) * sizeof(typename value_type::value_type);
+		}
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept
+		{
+			const auto len = static_cast<Length>(count(msg_));
+			const auto bytes = size(msg_) - sizeof(Length);
+			std::memcpy(out_, &len, sizeof(Length));
+			std::memcpy(out_ + sizeof(Length), (msg_.*Member).data(), bytes);
+			return out_ + sizeof(Length) + bytes;
+		}
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			Length len;
+			if (in_.size() < sizeof(Length))
+				return false;
+			std::memcpy(&len, in_.data(), sizeof(Length));
+
+			const usize bytes = static_cast<usize>(len) * sizeof(typename value_type::value_type);
+			if (in_.size() - sizeof(Length) < bytes)
+				return false;
+			if (!detail::read_range(msg_.*Member, in_.subspan(sizeof(Length), bytes)))
+				return false;
+			in_ = in_.subspan(sizeof(Length) + bytes);
+			return true;
+		}
+	};
+
+	template<auto Member>
+	struct tail
+	{
+		using value_type = detail::member_t<Member>;
+		static_assert(detail::byte_range<value_type>);
+
+		static inline constexpr bool is_fixed = false;
+		static inline constexpr bool is_tail = true;
+		static inline constexpr usize fixed_size = 0;
+
+		template<typename T>
+		static usize size(const T& msg_) noexcept { return detail::range_bytes(msg_.*Member); }
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept
+		{
+			const auto bytes = size(msg_);
+			std::memcpy(out_, (msg_.*Member).data(), bytes);
+			return out_ + bytes;
+		}
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			if (!detail::read_range(msg_.*Member, in_))
+				return false;
+			in_ = {};
+			return true;
+		}
+	};
+
+	// Always written, only read when the body still has it, so it can only be the last field
+	template<auto Member>
+	struct trailer
+	{
+		using value_type = detail::member_t<Member>;
+		static_assert(std::is_trivially_copyable_v<value_type>);
+
+		static inline constexpr bool is_fixed = true;
+		static inline constexpr bool is_tail = true;
+		static inline constexpr usize fixed_size = sizeof(value_type);
+
+		template<typename T>
+		static constexpr usize size(const T&) noexcept { return fixed_size; }
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept { return field<Member>::write(msg_, out_); }
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			if (in_.size() < fixed_size)
+				return true;
+			return field<Member>::read(msg_, in_);
+		}
+	};
+
+	template<auto Member>
+	struct nested
+	{
+		using value_type = detail::member_t<Member>;
+		using schema = typename value_type::schema;
+
+		static inline constexpr bool is_fixed = schema::is_fixed;
+		static inline constexpr bool is_tail = schema::is_tail;
+		static inline constexpr usize fixed_size = schema::fixed_size;
+
+		template<typename T>
+		static constexpr usize size(const T& msg_) noexcept { return schema::size(msg_.*Member); }
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept { return schema::write(msg_.*Member, out_); }
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept { return schema::read(msg_.*Member, in_); }
+	};
+
+	template<typename... Fields>
+	struct Schema;
+
+	// Elements are encoded one after the other with Fields, the member pointers of Fields belong to the element type
+	template<auto Member, std::unsigned_integral Count, typename... Fields>
+	struct list
+	{
+		using value_type = detail::member_t<Member>;
+		using element_schema = Schema<Fields...>;
+		static_assert(!element_schema::is_tail, "list element can't end with a tail");
+
+		static inline constexpr bool is_fixed = false;
+		static inline constexpr bool is_tail = false;
+		static inline constexpr usize fixed_size = sizeof(Count);
+
+		template<typename T>
+		static usize count(const T& msg_) noexcept
+		{
+			return std::min<usize>((msg_.*Member).size(), std::numeric_limits<Count>::max());
+		}
+
+		template<typename T>
+		static usize size(const T& msg_) noexcept
+		{
+			const auto n = count(msg_);
+			if constexpr (element_schema::is_fixed)
+				return sizeof(Count) + n * element_schema::fixed_size;
+
+			usize result = sizeof(Count);
+			for (usize i = 0; i < n; ++i)
+				result += element_schema::size((msg_.*Member)[i]);
+			return result;
+		}
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept
+		{
+			const auto n = static_cast<Count>(count(msg_));
+			std::memcpy(out_, &n, sizeof(Count));
+			out_ += sizeof(Count);
+			for (usize i = 0; i < n; ++i)
+				out_ = element_schema::write((msg_.*Member)[i], out_);
+			return out_;
+		}
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			Count n;
+			if (in_.size() < sizeof(Count))
+				return false;
+			std::memcpy(&n, in_.data(), sizeof(Count));
+			in_ = in_.subspan(sizeof(Count));
+
+			auto& elements = msg_.*Member;
+			elements.clear();
+			// Count comes from the peer, don't reserve more than the body can hold
+			elements.reserve(std::min<usize>(n, in_.size() / std::max<usize>(element_schema::fixed_size, 1)));
+			for (usize i = 0; i < n; ++i)
+			{
+				if (!element_schema::read(elements.emplace_back(), in_))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	template<typename... Fields>
+	struct Schema
+	{
+		static_assert(sizeof...(Fields) > 0);
+
+		static inline constexpr bool is_fixed = (Fields::is_fixed && ...);
+		static inline constexpr bool is_tail = std::array<bool, sizeof...(Fields)>{ Fields::is_tail... }.back();
+		// Size of the fixed part, the whole size when is_fixed
+		static inline constexpr usize fixed_size = (Fields::fixed_size + ...);
+
+		static_assert([] {
+			constexpr std::array<bool, sizeof...(Fields)> tails{ Fields::is_tail... };
+			return std::none_of(tails.begin(), tails.end() - 1, [](bool t_) { return t_; });
+		}(), "only the last field can be a tail");
+
+		template<typename T>
+		static constexpr usize size(const T& msg_) noexcept
+		{
+			if constexpr (is_fixed)
+				return fixed_size;
+			else
+				return (Fields::size(msg_) + ...);
+		}
+
+		template<typename T>
+		static byte_buffer serialize(const T& msg_) noexcept
+		{
+			byte_buffer result(size(msg_));
+			write(msg_, result.data());
+			return result;
+		}
+
+		/**
+		 * \brief decode every field in order
+		 * \return false when body_ is too short for them, trailing bytes after the last field are ignored
+		 */
+		template<typename T>
+		static bool deserialize(T& msg_, std::span<const u8> body_) noexcept
+		{
+			return read(msg_, body_);
+		}
+
+		template<typename T>
+		static u8* write(const T& msg_, u8* out_) noexcept
+		{
+			((out_ = Fields::write(msg_, out_)), ...);
+			return out_;
+		}
+
+		template<typename T>
+		static bool read(T& msg_, std::span<const u8>& in_) noexcept
+		{
+			return (Fields::read(msg_, in_) && ...);
+		}
+	};
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <array>
+#include <span>
+#include <cstring>
+
+#include "message.h"
+#include "frame.h"
+#include "util/types.h"
+
+namespace ar
+{
+	// Payload: ####$@@@@@@@@%%%%%%%%...
+	// #: stream id
+	// $: type of the whole body
+	// @: total body size
+	// %: offset of this chunk on the body
+	// ...: chunk data
+	/**
+	 * \brief bounded fragment of a body that is too big for a single frame. Chunks of a stream arrive in order on the same connection
+	 * and are handed to IMessageHandler::on_new_in_stream one by one, the connection never reassembles them
+	 */
+	struct StreamChunk
+	{
+		using id_type = u32;
+
+		static inline constexpr usize header_size = sizeof(id_type) + sizeof(MessageType) + sizeof(u64) * 2;
+
+		id_type stream_id;
+		MessageType body_type;
+		u64 total_size;
+		u64 offset;
+		std::span<const u8> data;	// Points into the received message, only valid until the handler returns
+
+		[[nodiscard]] bool is_first() const noexcept { return offset == 0; }
+		[[nodiscard]] bool is_last() const noexcept { return offset + data.size() == total_size; }
+
+		bool deserialize(std::span<const u8> body_) noexcept
+		{
+			if (body_.size() < header_size)
+				return false;
+
+			usize pos = 0;
+			std::memcpy(&stream_id, body_.data() + pos, sizeof(id_type));
+			pos += sizeof(id_type);
+			std::memcpy(&body_type, body_.data() + pos, sizeof(MessageType));
+			pos += sizeof(MessageType);
+			std::memcpy(&total_size, body_.data() + pos, sizeof(u64));
+			pos += sizeof(u64);
+			std::memcpy(&offset, body_.data() + pos, sizeof(u64));
+			pos += sizeof(u64);
+			data = body_.subspan(pos);
+
+			return offset <= total_size && data.size() <= total_size - offset;
+		}
+	};
+
+	inline shared_frame make_stream_frame(StreamChunk::id_type stream_id_, MessageType body_type_, u64 total_size_, u64 offset_, std::span<const u8> data_)
+	{
+		std::array<u8, StreamChunk::header_size> header{};
+		usize pos = 0;
+		std::memcpy(header.data() + pos, &stream_id_, sizeof(StreamChunk::id_type));
+		pos += sizeof(StreamChunk::id_type);
+		std::memcpy(header.data() + pos, &body_type_, sizeof(MessageType));
+		pos += sizeof(MessageType);
+		std::memcpy(header.data() + pos, &total_size_, sizeof(u64));
+		pos += sizeof(u64);
+		std::memcpy(header.data() + pos, &offset_, sizeof(u64));
+
+		return std::allocate_shared<const Frame>(pool_allocator<Frame>{}, MessageType::Stream, header, data_);
+	}
+}
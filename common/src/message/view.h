@@ -0,0 +1,81 @@
+#pragma once
+#include <span>
+#include <string_view>
+
+#include "message.h"
+#include "util/types.h"
+#include "util/util.h"
+
+namespace ar
+{
+	// Views point into the body they were deserialized from, they are only valid while that body is neither modified nor destroyed.
+	// Layout of each one is the same as the owning message of the same name
+
+	struct ChatMessageView
+	{
+		using id_type = ChatMessage::id_type;
+
+		// Relay overwrites the opponent id with the id of the sender, the rest of the body is forwarded as it is
+		static inline constexpr usize opponent_id_offset = sizeof(ChatOpponent);
+
+		ChatOpponent opponent;
+		id_type opponent_id;
+		std::span<const u8> message;
+
+		bool deserialize(std::span<const u8> body_) noexcept
+		{
+			const auto dest_type = span_to<u8>(body_);
+			const auto id = span_to<id_type>(body_, opponent_id_offset);
+			if (!dest_type || !id)
+				return false;
+
+			opponent = static_cast<ChatOpponent>(*dest_type);
+			opponent_id = *id;
+			message = body_.subspan(opponent_id_offset + sizeof(id_type));
+			return true;
+		}
+
+		[[nodiscard]] std::string_view message_str() const noexcept
+		{
+			return { reinterpret_cast<const char*>(message.data()), message.size() };
+		}
+	};
+
+	struct AuthenticateMessageView
+	{
+		std::string_view username;
+		std::span<const u8> public_key;
+
+		bool deserialize(std::span<const u8> body_) noexcept
+		{
+			const auto username_len = span_to<u16>(body_);
+			if (!username_len || body_.size() < sizeof(u16) + *username_len)
+				return false;
+
+			const auto uname = body_.subspan(sizeof(u16), *username_len);
+			username = { reinterpret_cast<const char*>(uname.data()), uname.size() };
+			public_key = body_.subspan(sizeof(u16) + *username_len);
+			return true;
+		}
+	};
+
+	struct NewUserMessageView
+	{
+		using id_type = NewUserMessage::id_type;
+
+		id_type id;
+		std::string_view name;
+
+		bool deserialize(std::span<const u8> body_) noexcept
+		{
+			const auto id_p = span_to<id_type>(body_);
+			if (!id_p)
+				return false;
+
+			id = *id_p;
+			const auto name_span = body_.subspan(sizeof(id_type));
+			name = { reinterpret_cast<const char*>(name_span.data()), name_span.size() };
+			return true;
+		}
+	};
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+#include "message.h"
+#include "util/types.h"
+
+namespace ar
+{
+	/*
+	 * Framing of the header in front of every body, negotiated per connection and per direction:
+	 *
+	 * V1	MessageType + u32 body size copied as Message::Header, 8 bytes with the padding and in host order
+	 * V2	MessageType (1 byte) + body size as little endian base 128 varint, 2 bytes for bodies under 128 bytes and 3 under 16KiB
+	 *
+	 * Every connection starts on V1. The server appends the highest version it speaks to ValidationMessage, older clients ignore it.
+	 * A client that speaks it as well sends a Version frame before its answer, the server replies with one. Version frame is the last V1
+	 * frame of its direction, everything after it is framed with the version it carries
+	 */
+	struct VersionMessage
+	{
+		WireVersion version;
+
+		using schema = Schema<field<&VersionMessage::version>>;
+
+		[[nodiscard]] byte_buffer serialize() const noexcept { return schema::serialize(*this); }
+
+		[[nodiscard]] MessageType type() const noexcept { return MessageType::Version; }
+
+		bool deserialize(std::span<const u8> body_) noexcept { return schema::deserialize(*this, body_); }
+
+		constexpr usize size() const noexcept { return schema::size(*this); }
+	};
+
+	// u32 never takes more than 5 bytes as varint
+	static inline constexpr usize max_varint_size = 5;
+	static inline constexpr usize max_v2_header_size = sizeof(MessageType) + max_varint_size;
+
+	inline usize write_varint(u32 value_, u8* out_) noexcept
+	{
+		usize size = 0;
+		while (value_ >= 0x80)
+		{
+			out_[size++] = static_cast<u8>(value_ | 0x80);
+			value_ >>= 7;
+		}
+		out_[size++] = static_cast<u8>(value_);
+		return size;
+	}
+
+	/**
+	 * \brief decode varint at the front of bytes_
+	 * \return value and its size, std::nullopt when bytes_ ends first. Size 0 means the varint is malformed
+	 */
+	inline std::optional<std::pair<u32, usize>> read_varint(std::span<const u8> bytes_) noexcept
+	{
+		u64 value = 0;
+		for (usize i = 0; i < max_varint_size; ++i)
+		{
+			if (i == bytes_.size())
+				return std::nullopt;
+			value |= static_cast<u64>(bytes_[i] & 0x7F) << (7 * i);
+			if (!(bytes_[i] & 0x80))
+			{
+				if (value > std::numeric_limits<u32>::max())
+					break;
+				return std::make_pair(static_cast<u32>(value), i + 1);
+			}
+		}
+		return std::make_pair(u32{}, usize{});
+	}
+
+	struct FrameHeader
+	{
+		MessageType type;
+		u32 body_size;
+		usize size;		// Bytes of the header itself
+	};
+
+	/**
+	 * \brief decode the header at the front of bytes_ framed with version_
+	 * \return std::nullopt while more bytes are needed, size 0 when the header is malformed
+	 */
+	inline std::optional<FrameHeader> parse_frame_header(WireVersion version_, std::span<const u8> bytes_) noexcept
+	{
+		if (version_ == WireVersion::V1)
+		{
+			if (bytes_.size() < Message::header_size)
+				return std::nullopt;
+			Message::Header header;
+			std::memcpy(&header, bytes_.data(), Message::header_size);
+			return FrameHeader{ header.id, header.body_size, Message::header_size };
+		}
+
+		if (bytes_.empty())
+			return std::nullopt;
+		const auto body_size = read_varint(bytes_.subspan(sizeof(MessageType)));
+		if (!body_size)
+			return std::nullopt;
+		if (!body_size->second)
+			return FrameHeader{};
+		return FrameHeader{ static_cast<MessageType>(bytes_[0]), body_size->first, sizeof(MessageType) + body_size->second };
+	}
+
+	// Frames sent with V2 and the header bytes they saved compared to the V1 header, per MessageType. Bodies are the same bytes on
+	// both versions, so only the header is counted. Shared by every connection of the process
+	struct WireCounters
+	{
+		static inline constexpr usize type_count = static_cast<usize>(std::numeric_limits<std::underlying_type_t<MessageType>>::max()) + 1;
+
+		std::array<std::atomic<u64>, type_count> frames{};
+		std::array<std::atomic<u64>, type_count> saved_header_bytes{};
+
+		void count(MessageType type_, usize v2_header_size_) noexcept
+		{
+			const auto index = static_cast<usize>(type_);
+			frames[index].fetch_add(1, std::memory_order_relaxed);
+			saved_header_bytes[index].fetch_add(Message::header_size - v2_header_size_, std::memory_order_relaxed);
+		}
+	};
+
+	inline WireCounters& wire_counters() noexcept
+	{
+		static WireCounters counters{};
+		return counters;
+	}
+}
@@ -0,0 +1,217 @@
+#pragma once
+#include <deque>
+#include <iterator>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "connection_config.h"
+#include "message/frame.h"
+#include "message/batch.h"
+#include "util/types.h"
+#include "util/util.h"
+
+namespace ar
+{
+	// How often each slow consumer policy fired, shared by every connection of the process
+	struct SlowConsumerCounters
+	{
+		std::atomic<u64> dropped{};			// Presence frames dropped by SlowConsumerPolicy::DropPresence
+		std::atomic<u64> coalesced{};		// Presence frames removed by SlowConsumerPolicy::Coalesce
+		std::atomic<u64> disconnected{};	// Connections closed because the queue stayed above the high watermark
+	};
+
+	inline SlowConsumerCounters& slow_consumer_counters() noexcept
+	{
+		static SlowConsumerCounters counters{};
+		return counters;
+	}
+
+	/**
+	 * \brief outbound frames of a single connection, bounded by the watermarks on ConnectionConfig
+	 */
+	class OutboundQueue
+	{
+	public:
+		using container_type = std::deque<shared_frame, pool_allocator<shared_frame>>;
+		using const_iterator = container_type::const_iterator;
+
+		explicit OutboundQueue(const ConnectionConfig& config_) : m_config{config_}, m_bytes{}
+		{
+		}
+
+		/**
+		 * \brief enqueue frame and run the slow consumer policy when the queue is above the high watermark
+		 * \param in_flight_ frames on the front of the queue that are being written, they are never dropped
+		 * \return false when the connection should be closed
+		 */
+		[[nodiscard]] bool push(shared_frame frame_, usize in_flight_) noexcept
+		{
+			m_bytes += frame_->size();
+			m_frames.emplace_back(std::move(frame_));
+
+			if (!above_high_watermark())
+				return true;
+
+			switch (m_config.slow_consumer_policy)
+			{
+			case SlowConsumerPolicy::DropPresence:
+				slow_consumer_counters().dropped += drop_presence(in_flight_);
+				break;
+			case SlowConsumerPolicy::Coalesce:
+				slow_consumer_counters().coalesced += coalesce_presence(in_flight_);
+				break;
+			case SlowConsumerPolicy::Disconnect:
+				break;
+			}
+
+			// Policy couldn't bring the queue back, the consumer is too slow
+			if (above_high_watermark())
+			{
+				++slow_consumer_counters().disconnected;
+				return false;
+			}
+			return true;
+		}
+
+		void pop_front() noexcept
+		{
+			m_bytes -= m_frames.front()->size();
+			m_frames.pop_front();
+		}
+
+		void clear() noexcept
+		{
+			m_frames.clear();
+			m_bytes = 0;
+		}
+
+		/**
+		 * \brief remove every frame of type_, for frames that should outlive the connection
+		 * \return removed frames in queue order
+		 */
+		std::vector<shared_frame> take(MessageType type_) noexcept
+		{
+			std::vector<shared_frame> result{};
+			std::ranges::copy_if(m_frames, std::back_inserter(result), [&](const shared_frame& frame_) { return frame_->type() == type_; });
+			std::erase_if(m_frames, [&](const shared_frame& frame_)
+			{
+				if (frame_->type() != type_)
+					return false;
+				m_bytes -= frame_->size();
+				return true;
+			});
+			return result;
+		}
+
+		[[nodiscard]] const shared_frame& front() const noexcept { return m_frames.front(); }
+		[[nodiscard]] bool empty() const noexcept { return m_frames.empty(); }
+		[[nodiscard]] usize size() const noexcept { return m_frames.size(); }
+		[[nodiscard]] usize bytes() const noexcept { return m_bytes; }
+
+		[[nodiscard]] const_iterator begin() const noexcept { return m_frames.begin(); }
+		[[nodiscard]] const_iterator end() const noexcept { return m_frames.end(); }
+
+		/**
+		 * \brief frames from first_ that can be packed into one Batch frame of up to max_bytes_ body
+		 * \return 1 when first_ should go out on its own
+		 */
+		[[nodiscard]] usize batch_length(const_iterator first_, usize max_body_, usize max_bytes_) const noexcept
+		{
+			usize count = 0;
+			usize bytes = 0;
+			for (auto it = first_; it != m_frames.end() && is_batchable(**it, max_body_); ++it, ++count)
+			{
+				bytes += (*it)->header(WireVersion::V2).size() + (*it)->body().size();
+				if (bytes > max_bytes_)
+					break;
+			}
+			return std::max<usize>(count, 1);
+		}
+
+	private:
+		[[nodiscard]] bool above_high_watermark() const noexcept
+		{
+			return m_bytes > m_config.high_watermark_bytes || m_frames.size() > m_config.high_watermark_frames;
+		}
+
+		[[nodiscard]] bool above_low_watermark() const noexcept
+		{
+			return m_bytes > m_config.low_watermark_bytes || m_frames.size() > m_config.low_watermark_frames;
+		}
+
+		static bool is_presence(const shared_frame& frame_) noexcept
+		{
+			const auto type = frame_->type();
+			return type == MessageType::NewUser || type == MessageType::UserDisconnect;
+		}
+
+		// Drop the oldest presence frames until the queue is below the low watermark
+		usize drop_presence(usize in_flight_) noexcept
+		{
+			usize count = 0;
+			for (auto it = m_frames.begin() + static_cast<isize>(in_flight_); it != m_frames.end() && above_low_watermark();)
+			{
+				if (!is_presence(*it))
+				{
+					++it;
+					continue;
+				}
+				m_bytes -= (*it)->size();
+				it = m_frames.erase(it);
+				++count;
+			}
+			return count;
+		}
+
+		// NewUser followed by UserDisconnect of the same id doesn't change what the consumer sees, remove both of them
+		usize coalesce_presence(usize in_flight_) noexcept
+		{
+			std::unordered_map<u32, const Frame*> new_users{};
+			std::unordered_set<const Frame*> removed{};
+
+			for (auto it = m_frames.begin() + static_cast<isize>(in_flight_); it != m_frames.end(); ++it)
+			{
+				if (!is_presence(*it))
+					continue;
+
+				// NewUserMessage and UserDisconnectMessage both start with the user id
+				const auto id_p = span_to<u32>((*it)->body());
+				if (!id_p)
+					continue;
+				const auto id = *id_p;
+				if ((*it)->type() == MessageType::NewUser)
+				{
+					new_users[id] = it->get();
+					continue;
+				}
+
+				const auto new_user = new_users.find(id);
+				if (new_user == new_users.end())
+					continue;
+				removed.insert(new_user->second);
+				removed.insert(it->get());
+				new_users.erase(new_user);
+			}
+
+			if (removed.empty())
+				return 0;
+
+			const auto count = std::erase_if(m_frames, [&](const shared_frame& frame_)
+			{
+				if (!removed.contains(frame_.get()))
+					return false;
+				m_bytes -= frame_->size();
+				return true;
+			});
+			return count;
+		}
+
+	private:
+		ConnectionConfig m_config;
+		container_type m_frames;
+		usize m_bytes;
+	};
+}
@@ -1,21 +1,62 @@
 ﻿#include "server.h"
 
+#include <filesystem>
 #include <spdlog/spdlog.h>
 
-#include "Connection.h"
+#include "connection.h"
 
 
 namespace ar
 {
 	IServer::IServer(const asio::ip::tcp::endpoint& endpoint_, IConnectionHandler& conn_handler_,
-		int concurrency_hint_)
-		: m_context{ concurrency_hint_ }, m_connection_handler{conn_handler_}, m_acceptor{ m_context, endpoint_ }
+		int concurrency_hint_, const ConnectionConfig& connection_config_, bool reuse_port_)
+		: m_context{ 1 }, m_connection_handler{conn_handler_}, m_connection_config{connection_config_}, m_next_context{}
 	{
-		handle_accept();
+		// Each io_context is only run by one thread
+		for (int i = 1; i < concurrency_hint_; ++i)
+		{
+			auto& context = m_worker_contexts.emplace_back(std::make_unique<asio::io_context>(1));
+			m_worker_guards.emplace_back(context->get_executor());
+		}
+
+#ifdef AR_HAS_IO_URING
+		for (usize i = 0; i < context_count(); ++i)
+		{
+			asio::make_service<RegisteredBuffers>(context(i), m_connection_config.registered_receive_slots, m_connection_config.read_buffer_size);
+			asio::make_service<MultishotReceiver>(context(i), m_connection_config.multishot_receive_buffers, m_connection_config.multishot_buffer_size);
+		}
+#endif
+
+#ifdef AR_HAS_REUSE_PORT
+		if (reuse_port_ && context_count() > 1)
+		{
+			m_acceptors.reserve(context_count());
+			for (usize i = 0; i < context_count(); ++i)
+			{
+				auto& acceptor = m_acceptors.emplace_back(context(i));
+				acceptor.open(endpoint_.protocol());
+				acceptor.set_option(asio::ip::tcp::acceptor::reuse_address{ true });
+				acceptor.set_option(reuse_port{ true });
+				acceptor.bind(endpoint_);
+				acceptor.listen();
+			}
+		}
+#else
+		if (reuse_port_)
+			spdlog::warn("SO_REUSEPORT is not supported on this platform, fallback to single acceptor");
+#endif
+		if (m_acceptors.empty())
+			m_acceptors.emplace_back(m_context, endpoint_);
+
+		for (auto& acceptor : m_acceptors)
+			handle_accept(acceptor, m_acceptors.size() > 1);
 	}
 
 	void IServer::start(bool separate_thread_) noexcept
 	{
+		for (auto& context : m_worker_contexts)
+			m_worker_threads.emplace_back([&context] { context->run(); });
+
 		if (!separate_thread_)
 		{
 			m_context.run();
@@ -30,20 +71,99 @@ namespace ar
 		if (!m_context.stopped())
 			m_context.stop();
 
+		for (auto& guard : m_worker_guards)
+			guard.reset();
+
+		for (const auto& context : m_worker_contexts)
+		{
+			if (!context->stopped())
+				context->stop();
+		}
+
 		if (m_context_thread.joinable())
 			m_context_thread.join();
+
+		for (auto& thread : m_worker_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+		m_worker_threads.clear();
+		// Sockets of the connections shouldn't outlive their event loops
+		m_connection_handler->clear_connections();
+
+#ifdef AR_HAS_LOCAL_SOCKETS
+		for (auto& acceptor : m_local_acceptors)
+		{
+			asio::error_code ec;
+			const auto endpoint = acceptor.local_endpoint(ec);
+			acceptor.close(ec);
+			std::error_code remove_ec;
+			if (!ec)
+				std::filesystem::remove(endpoint.path(), remove_ec);
+		}
+		m_local_acceptors.clear();
+#endif
+
+		const auto& counters = wire_counters();
+		for (usize type = 0; type < WireCounters::type_count; ++type)
+		{
+			const auto frames = counters.frames[type].load(std::memory_order_relaxed);
+			if (frames)
+				spdlog::info("Wire V2 headers: type {} saved {} header bytes over {} frames", type, counters.saved_header_bytes[type].load(std::memory_order_relaxed), frames);
+		}
+	}
+
+#ifdef AR_HAS_LOCAL_SOCKETS
+	bool IServer::listen(const asio::local::stream_protocol::endpoint& endpoint_, bool shm_ring_) noexcept
+	{
+#ifndef AR_HAS_SHM_RING
+		if (shm_ring_)
+		{
+			spdlog::error("Shared memory rings are not supported on this platform, not listening on {}", endpoint_.path());
+			return false;
+		}
+#endif
+
+		// Socket file of the previous run makes bind fail
+		std::error_code remove_ec;
+		std::filesystem::remove(endpoint_.path(), remove_ec);
+
+		asio::error_code ec;
+		auto& acceptor = m_local_acceptors.emplace_back(m_context);
+		acceptor.open(endpoint_.protocol(), ec);
+		if (!ec)
+			acceptor.bind(endpoint_, ec);
+		if (!ec)
+			acceptor.listen(asio::socket_base::max_listen_connections, ec);
+		if (ec)
+		{
+			spdlog::error("Failed to listen on {}: {}", endpoint_.path(), ec.message());
+			m_local_acceptors.pop_back();
+			return false;
+		}
+
+		// Single acceptor, connections are distributed over the event loops like the TCP one
+		handle_accept(acceptor, false, shm_ring_);
+		return true;
 	}
+#endif
 
 	void IServer::broadcast(connection_type::id_type sender_id_, const Message& message_) noexcept
 	{
+		// Serialize once, every connection only holds a reference to the frame
+		const auto frame = make_frame(message_);
 		auto connections = m_connection_handler->connections();
-		for (auto conn: connections /*| std::ranges::views::filter([id = sender_id_](const connection_type& conn){ return conn.id() != id; })*/)
-			conn->send(message_);
+		for (const auto& conn: connections /*| std::ranges::views::filter([id = sender_id_](const connection_type& conn){ return conn.id() != id; })*/)
+			conn->send(frame);
 	}
 
-	void IServer::handle_accept() noexcept
+	template<typename Acceptor>
+	void IServer::handle_accept(Acceptor& acceptor_, bool sharded_, bool shm_ring_) noexcept
 	{
-		m_acceptor.async_accept([&](const asio::error_code& ec_, asio::ip::tcp::socket&& socket_)
+		// The socket is bound to the event loop it will live on, sharded acceptor keep it on its own event loop
+		auto& context = sharded_ ? static_cast<asio::io_context&>(acceptor_.get_executor().context()) : next_context();
+		acceptor_.async_accept(context, [this, acceptor = &acceptor_, sharded_, shm_ring_](const asio::error_code& ec_, stream_socket&& socket_)
 			{
 				if (ec_)
 				{
@@ -51,17 +171,30 @@ namespace ar
 					return;
 				}
 
-				auto conn = m_connection_handler->add_connection(std::forward<asio::ip::tcp::socket>(socket_), *this);
+				auto conn = m_connection_handler->add_connection(std::move(socket_), *this, m_connection_config);
 				
 				if (!on_new_connection(*conn))
 				{
 					m_connection_handler->remove_connection(*conn);
-					handle_accept();
+					handle_accept(*acceptor, sharded_, shm_ring_);
 					return;
 				}
-				m_connection_handler->start_validation(*conn);
+				// Handshake runs on the event loop that owns the connection
+				conn->establish(shm_ring_);
 
-				handle_accept();
+				handle_accept(*acceptor, sharded_, shm_ring_);
 			});
 	}
-}
+
+	asio::io_context& IServer::next_context() noexcept
+	{
+		return context(m_next_context++ % context_count());
+	}
+
+	asio::io_context& IServer::context(usize index_) noexcept
+	{
+		if (!index_)
+			return m_context;
+		return *m_worker_contexts[index_ - 1];
+	}
+}
\ No newline at end of file
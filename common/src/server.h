@@ -1,9 +1,14 @@
 ﻿#pragma once
 #include <thread>
+#include <vector>
+#include <deque>
+#include <memory>
 #include <asio/io_context.hpp>
+#include <asio/executor_work_guard.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/local/stream_protocol.hpp>
 
-#include "Connection.h"
+#include "connection.h"
 #include "util/literal.h"
 #include "message/command.h"
 
@@ -13,27 +18,56 @@ namespace ar
 	{
 	public:
 		using connection_type = ServerConnection;
+		using work_guard_type = asio::executor_work_guard<asio::io_context::executor_type>;
 
-		explicit IServer(const asio::ip::tcp::endpoint& endpoint_, IConnectionHandler& conn_handler_, int concurrency_hint_ = std::thread::hardware_concurrency());
+		/**
+		 * \brief concurrency_hint_ is the count of event loop threads, each thread runs its own io_context and accepted connections are distributed round-robin.
+		 * When reuse_port_ is set, every event loop opens its own acceptor on the same port with SO_REUSEPORT and the kernel balances the incoming connections
+		 */
+		explicit IServer(const asio::ip::tcp::endpoint& endpoint_, IConnectionHandler& conn_handler_, int concurrency_hint_ = std::thread::hardware_concurrency(), const ConnectionConfig& connection_config_ = {}, bool reuse_port_ = false);
 		~IServer() override = default;
 
 		void start(bool separate_thread_ = true) noexcept;
 		void stop() noexcept;
 
+#ifdef AR_HAS_LOCAL_SOCKETS
+		/**
+		 * \brief accept connections on an AF_UNIX stream socket as well, should be called before start. Socket file left on the path is replaced.
+		 * With shm_ring_ every peer on it passes a ShmRing first and sends its frames through the ring (Linux only)
+		 */
+		bool listen(const asio::local::stream_protocol::endpoint& endpoint_, bool shm_ring_ = false) noexcept;
+#endif
+
 		void broadcast(connection_type::id_type sender_id_, const Message& message_) noexcept;
 
 	protected:
 		virtual bool on_new_connection(connection_type& conn_) noexcept { return true; }
 
 	private:
-		void handle_accept() noexcept;
+		template<typename Acceptor>
+		void handle_accept(Acceptor& acceptor_, bool sharded_, bool shm_ring_ = false) noexcept;
+
+		// Next event loop for a new connection
+		asio::io_context& next_context() noexcept;
+
+		asio::io_context& context(usize index_) noexcept;
+		usize context_count() const noexcept { return m_worker_contexts.size() + 1; }
 
 	protected:
-		asio::io_context m_context;
+		asio::io_context m_context;		// Event loop of the acceptor, also the first event loop of the pool
 		ref<IConnectionHandler> m_connection_handler;
+		ConnectionConfig m_connection_config;
 
 	private:
 		std::thread m_context_thread;
-		asio::ip::tcp::acceptor m_acceptor;
+		std::vector<std::unique_ptr<asio::io_context>> m_worker_contexts;
+		std::vector<work_guard_type> m_worker_guards;
+		std::vector<std::thread> m_worker_threads;
+		usize m_next_context;
+
+		std::vector<asio::ip::tcp::acceptor> m_acceptors;	// Single acceptor or one acceptor per event loop when sharded
+#ifdef AR_HAS_LOCAL_SOCKETS
+		std::deque<asio::local::stream_protocol::acceptor> m_local_acceptors;	// Deque, pending accepts keep the address of their acceptor
+#endif
 	};
 }
@@ -1,5 +1,8 @@
 #pragma once
 #include <asio/error_code.hpp>
+#include <asio/socket_base.hpp>
+#include <asio/generic/stream_protocol.hpp>
+#include <asio/local/stream_protocol.hpp>
 
 namespace ar
 {
@@ -10,4 +13,29 @@ namespace ar
 		|| ec_ == asio::error::connection_reset
 		|| ec_ == asio::error::operation_aborted;
 	}
+
+#if defined(SO_REUSEPORT)
+#define AR_HAS_REUSE_PORT
+	// Several sockets can bind the same address and port, the kernel balances incoming connections between them
+	using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+	// AF_UNIX stream sockets, for clients on the same host
+#define AR_HAS_LOCAL_SOCKETS
+#endif
+
+#if defined(__linux__) && defined(AR_HAS_LOCAL_SOCKETS) && defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
+	// Shared memory ring handed over an AF_UNIX socket, needs memfd and eventfd
+#define AR_HAS_SHM_RING
+#endif
+
+	// Connections hold any stream socket (TCP or AF_UNIX), so one ConnectionManager serves every transport
+	using stream_socket = asio::generic::stream_protocol::socket;
+	using stream_endpoint = asio::generic::stream_protocol::endpoint;
+
+#if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+	// Socket I/O goes through io_uring, set by CHATTY_USE_IO_URING
+#define AR_HAS_IO_URING
+#endif
 }
@@ -0,0 +1,145 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <bit>
+#include <new>
+
+#include "types.h"
+
+namespace ar
+{
+	/**
+	 * \brief size-classed free lists of byte blocks, one pool per thread (event loop) so allocation never takes a lock.
+	 * Block released on another thread goes into that thread's pool. Objects with static lifetime may release their blocks after
+	 * the pool of the thread is destroyed on exit, those go straight to the system allocator
+	 */
+	class BufferPool
+	{
+	public:
+		static constexpr usize min_block_size = 32;
+		static constexpr usize max_block_size = 64 * 1024;
+		static constexpr usize class_count = std::countr_zero(max_block_size) - std::countr_zero(min_block_size) + 1;
+		// Blocks kept per size class, the rest is returned to the system allocator
+		static constexpr usize max_cached_blocks = 256;
+
+		BufferPool(const BufferPool& other) = delete;
+		BufferPool& operator=(const BufferPool& other) = delete;
+
+		// Should not be called once is_destroyed is true
+		static BufferPool& local() noexcept
+		{
+			thread_local BufferPool pool{};
+			return pool;
+		}
+
+		// Pool of this thread is gone, the thread is exiting
+		[[nodiscard]] static bool is_destroyed() noexcept { return s_destroyed; }
+
+		[[nodiscard]] static void* allocate_local(usize size_)
+		{
+			if (is_destroyed())
+				return ::operator new(size_);
+			return local().allocate(size_);
+		}
+
+		static void deallocate_local(void* block_, usize size_) noexcept
+		{
+			if (is_destroyed())
+			{
+				::operator delete(block_);
+				return;
+			}
+			local().deallocate(block_, size_);
+		}
+
+		[[nodiscard]] void* allocate(usize size_)
+		{
+			const auto index = class_index(size_);
+			if (index >= class_count)
+				return ::operator new(size_);
+
+			auto& list = m_free_blocks[index];
+			if (list.empty())
+				return ::operator new(block_size(index));
+
+			const auto block = list.back();
+			list.pop_back();
+			return block;
+		}
+
+		void deallocate(void* block_, usize size_) noexcept
+		{
+			const auto index = class_index(size_);
+			if (index >= class_count || m_free_blocks[index].size() >= max_cached_blocks)
+			{
+				::operator delete(block_);
+				return;
+			}
+			m_free_blocks[index].push_back(block_);
+		}
+
+	private:
+		// Only local() makes one, so the flag of the thread is only set by its own pool
+		BufferPool()
+		{
+			for (auto& list : m_free_blocks)
+				list.reserve(max_cached_blocks);
+		}
+
+		~BufferPool()
+		{
+			for (const auto& list : m_free_blocks)
+			{
+				for (const auto block : list)
+					::operator delete(block);
+			}
+			s_destroyed = true;
+		}
+
+		static constexpr usize class_index(usize size_) noexcept
+		{
+			if (size_ <= min_block_size)
+				return 0;
+			return std::bit_width(size_ - 1) - std::countr_zero(min_block_size);
+		}
+
+		static constexpr usize block_size(usize index_) noexcept
+		{
+			return min_block_size << index_;
+		}
+
+	private:
+		std::array<std::vector<void*>, class_count> m_free_blocks;
+
+		// Trivially destructible, still readable after the pool itself is destroyed
+		static inline thread_local bool s_destroyed = false;
+	};
+
+	template<typename T>
+	class pool_allocator
+	{
+	public:
+		using value_type = T;
+
+		pool_allocator() noexcept = default;
+
+		template<typename U>
+		pool_allocator(const pool_allocator<U>&) noexcept {}
+
+		[[nodiscard]] T* allocate(usize count_)
+		{
+			return static_cast<T*>(BufferPool::allocate_local(count_ * sizeof(T)));
+		}
+
+		void deallocate(T* ptr_, usize count_) noexcept
+		{
+			BufferPool::deallocate_local(ptr_, count_ * sizeof(T));
+		}
+
+		template<typename U>
+		friend bool operator==(const pool_allocator&, const pool_allocator<U>&) noexcept { return true; }
+	};
+
+	// Byte storage drawn from the thread pool, used by messages, serializers and outbound frames
+	using byte_buffer = std::vector<u8, pool_allocator<u8>>;
+}
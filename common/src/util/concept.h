@@ -1,6 +1,8 @@
 #pragma once
 #include <type_traits>
 
+#include "buffer_pool.h"
+
 namespace ar
 {
 	enum class MessageType : u8;
@@ -10,7 +12,7 @@ namespace ar {
 	template<typename T>
 	concept Serializable = requires(T t)
 	{
-		{t.serialize()} noexcept -> std::same_as<std::vector<u8>>;
+		{t.serialize()} noexcept -> std::same_as<byte_buffer>;
 		{t.size()} noexcept -> std::same_as<usize>;
 		{t.type()} noexcept -> std::same_as<MessageType>;
 	};
@@ -0,0 +1,112 @@
+#pragma once
+#include <optional>
+
+#include <cryptopp/integer.h>
+
+#include "types.h"
+
+namespace cry = ::CryptoPP;
+
+namespace ar
+{
+	enum class KeyGroup : u8
+	{
+		Fixed,		// Well known group of KeyConfig::key_size bits, generating a key pair is a single exponentiation
+		Random,		// Fresh group of KeyConfig::key_size bits per key pair, searches for a safe prime every time
+	};
+
+	struct KeyConfig
+	{
+		// Bits of the ElGamal modulus. Fixed groups exist for 1536, 2048, 3072 and 4096 bits, other sizes fall back to KeyGroup::Random
+		u32 key_size = 2048;
+		KeyGroup group = KeyGroup::Fixed;
+	};
+
+	struct GroupParameters
+	{
+		cry::Integer modulus;
+		cry::Integer generator;
+	};
+
+	namespace detail
+	{
+		// MODP groups 5, 14, 15 and 16 of RFC 3526, safe primes with generator 2
+		inline constexpr char modp_1536[] =
+			"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+			"020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+			"4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+			"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+			"98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+			"9ED529077096966D670C354E4ABC9804F1746C08CA237327FFFFFFFFFFFFFFFFh";
+
+		inline constexpr char modp_2048[] =
+			"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+			"020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+			"4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+			"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+			"98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+			"9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+			"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+			"3995497CEA956AE515D2261898FA051015728E5A8AACAA68FFFFFFFFFFFFFFFFh";
+
+		inline constexpr char modp_3072[] =
+			"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+			"020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+			"4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+			"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+			"98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+			"9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+			"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+			"3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+			"A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+			"ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+			"D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+			"08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFFh";
+
+		inline constexpr char modp_4096[] =
+			"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+			"020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+			"4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+			"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+			"98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+			"9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+			"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+			"3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+			"A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+			"ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+			"D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+			"08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A92108011A723C12A787E6D7"
+			"88719A10BDBA5B2699C327186AF4E23C1A946834B6150BDA2583E9CA2AD44CE8"
+			"DBBBC2DB04DE8EF92E8EFC141FBECAA6287C59474E6BC05D99B2964FA090C3A2"
+			"233BA186515BE7ED1F612970CEE2D7AFB81BDD762170481CD0069127D5B05AA9"
+			"93B4EA988D8FDDC186FFB7DC90A6C08F4DF435C934063199FFFFFFFFFFFFFFFFh";
+
+		inline GroupParameters make_group(const char* modulus_) noexcept
+		{
+			return GroupParameters{ cry::Integer{ modulus_ }, cry::Integer{ 2 } };
+		}
+	}
+
+	/**
+	 * \brief fixed group of key_size_ bits, parsed once on the first call
+	 * \return nullptr when there is no fixed group of that size
+	 */
+	inline const GroupParameters* fixed_group(u32 key_size_) noexcept
+	{
+		static const GroupParameters groups[]{
+			detail::make_group(detail::modp_1536),
+			detail::make_group(detail::modp_2048),
+			detail::make_group(detail::modp_3072),
+			detail::make_group(detail::modp_4096),
+		};
+
+		switch (key_size_)
+		{
+		case 1536: return &groups[0];
+		case 2048: return &groups[1];
+		case 3072: return &groups[2];
+		case 4096: return &groups[3];
+		default: return nullptr;
+		}
+	}
+}
@@ -0,0 +1,406 @@
+#pragma once
+#include "asio.h"
+
+#ifdef AR_HAS_IO_URING
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/bind_cancellation_slot.hpp>
+#include <asio/cancellation_signal.hpp>
+#include <asio/execution_context.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/use_awaitable.hpp>
+#include <spdlog/spdlog.h>
+
+#include "types.h"
+
+namespace ar
+{
+	class MultishotReceiver;
+
+	/**
+	 * \brief received bytes of a single socket, shared by its MultishotStream and the read waiting on it. Only touched on the event loop of the socket
+	 */
+	struct MultishotSubscription
+	{
+		MultishotSubscription(const asio::any_io_executor& executor_, u64 id_, int fd_) noexcept
+			: id{id_}, fd{fd_}, wakeup{executor_, asio::steady_timer::time_point::max()}
+		{
+		}
+
+		/**
+		 * \brief copy data_ straight into the waiting read, the rest is kept for the next read
+		 */
+		void deliver(std::span<const u8> data_) noexcept
+		{
+			if (!target.empty() && !received)
+			{
+				received = std::min(data_.size(), target.size());
+				std::memcpy(target.data(), data_.data(), received);
+				data_ = data_.subspan(received);
+				wakeup.cancel();
+			}
+			pending.insert(pending.end(), data_.begin(), data_.end());
+		}
+
+		/**
+		 * \brief move kept bytes into buffer_
+		 */
+		usize take(std::span<u8> buffer_) noexcept
+		{
+			const auto bytes = std::min(buffer_.size(), pending.size() - consumed);
+			std::memcpy(buffer_.data(), pending.data() + consumed, bytes);
+			consumed += bytes;
+			if (consumed == pending.size())
+			{
+				pending.clear();
+				consumed = 0;
+			}
+			return bytes;
+		}
+
+		// Reads still drain pending before they see ec_
+		void end(asio::error_code ec_) noexcept
+		{
+			if (!ec)
+				ec = ec_;
+			wakeup.cancel();
+		}
+
+		u64 id;
+		int fd;
+		std::vector<u8> pending;	// Received while no read was waiting
+		usize consumed{};
+		std::span<u8> target;		// Buffer of the waiting read
+		usize received{};
+		asio::error_code ec;		// Set once the receive ended
+		asio::steady_timer wakeup;	// Never expires, cancelled when target is filled or the receive ended
+	};
+
+	/**
+	 * \brief multishot receive armed for a connection socket, cancelled when destroyed. Should be destroyed before the socket is closed,
+	 * the armed receive holds the file open otherwise
+	 */
+	class MultishotStream
+	{
+	public:
+		MultishotStream(MultishotReceiver& owner_, std::shared_ptr<MultishotSubscription> subscription_) noexcept
+			: m_owner{&owner_}, m_subscription{std::move(subscription_)}
+		{
+		}
+
+		MultishotStream(const MultishotStream& other) = delete;
+		MultishotStream& operator=(const MultishotStream& other) = delete;
+
+		MultishotStream(MultishotStream&& other) noexcept
+			: m_owner{std::exchange(other.m_owner, nullptr)}, m_subscription{std::move(other.m_subscription)}
+		{
+		}
+
+		MultishotStream& operator=(MultishotStream&& other) noexcept
+		{
+			if (this == &other)
+				return *this;
+			release();
+			m_owner = std::exchange(other.m_owner, nullptr);
+			m_subscription = std::move(other.m_subscription);
+			return *this;
+		}
+
+		~MultishotStream() noexcept
+		{
+			release();
+		}
+
+		/**
+		 * \brief wait until anything is received into buffer_, bytes that came while nobody was reading are returned right away
+		 * \return asio::error::operation_not_supported when the kernel has no multishot receive, the caller should read the socket itself
+		 */
+		asio::awaitable<std::pair<asio::error_code, usize>> read(std::span<u8> buffer_, asio::cancellation_slot slot_) noexcept
+		{
+			// The stream can be released while the read waits, the subscription outlives both
+			const auto subscription = m_subscription;
+			if (subscription->pending.empty() && !subscription->ec)
+			{
+				asio::error_code ec;
+				subscription->target = buffer_;
+				co_await subscription->wakeup.async_wait(asio::bind_cancellation_slot(slot_, asio::redirect_error(asio::use_awaitable, ec)));
+				subscription->target = {};
+				if (const auto received = std::exchange(subscription->received, 0))
+					co_return std::pair{ asio::error_code{}, received };
+				// Neither delivered nor ended, cancelled through slot_
+				if (subscription->pending.empty() && !subscription->ec)
+					co_return std::pair{ ec ? ec : asio::error::operation_aborted, usize{} };
+			}
+			if (!subscription->pending.empty())
+				co_return std::pair{ asio::error_code{}, subscription->take(buffer_) };
+			co_return std::pair{ subscription->ec, usize{} };
+		}
+
+	private:
+		inline void release() noexcept;
+
+	private:
+		MultishotReceiver* m_owner;
+		std::shared_ptr<MultishotSubscription> m_subscription;
+	};
+
+	/**
+	 * \brief io_uring of an event loop that keeps one multishot receive armed per connection socket, each completion picks one of the provided buffers
+	 * shared by every connection. A socket costs a single submission for as long as the peer keeps sending, instead of one read per wakeup.
+	 * asio has no multishot operation, so the service runs its own ring next to the one of asio and reaps it whenever its eventfd becomes readable.
+	 * Installed with asio::make_service, connections on an event loop without it or on a kernel without multishot receive (Linux 6.0) read the socket themselves
+	 */
+	class MultishotReceiver : public asio::execution_context::service
+	{
+	public:
+		using key_type = MultishotReceiver;
+		static inline asio::execution_context::id id{};
+
+		// Only io_context is ever installed with it, see IServer
+		explicit MultishotReceiver(asio::execution_context& context_, usize buffer_count_ = 0, usize buffer_size_ = 0)
+			: asio::execution_context::service{context_}, m_buffer_count{buffer_count_}, m_buffer_size{buffer_size_},
+			  m_signal{static_cast<asio::io_context&>(context_).get_executor()}
+		{
+			if (!m_buffer_count || !m_buffer_size)
+				return;
+			// Buffer ids are 16 bits and the kernel indexes the ring with a mask
+			if (!std::has_single_bit(m_buffer_count) || m_buffer_count > max_buffer_count)
+			{
+				spdlog::warn("Multishot receive needs a power of two up to {} buffers, got {}", max_buffer_count, m_buffer_count);
+				return;
+			}
+
+			if (const auto error = io_uring_queue_init(queue_entries, &m_ring, 0); error < 0)
+			{
+				fail("ring setup", -error);
+				return;
+			}
+			m_ring_ready = true;
+
+			int error{};
+			m_buffers = io_uring_setup_buf_ring(&m_ring, static_cast<unsigned>(m_buffer_count), buffer_group, 0, &error);
+			if (!m_buffers)
+			{
+				fail("provided buffers", -error);
+				return;
+			}
+			m_storage.resize(m_buffer_count * m_buffer_size);
+			for (usize i = 0; i < m_buffer_count; ++i)
+				recycle(static_cast<u16>(i));
+
+			const auto event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (event < 0 || io_uring_register_eventfd(&m_ring, event) < 0)
+			{
+				fail("eventfd", errno);
+				if (event >= 0)
+					::close(event);
+				return;
+			}
+			asio::error_code ec;
+			m_signal.assign(event, ec);
+			if (ec)
+			{
+				::close(event);
+				return;
+			}
+
+			m_supported = true;
+			wait();
+		}
+
+		~MultishotReceiver() override
+		{
+			if (m_buffers)
+				io_uring_free_buf_ring(&m_ring, m_buffers, static_cast<unsigned>(m_buffer_count), buffer_group);
+			if (m_ring_ready)
+				io_uring_queue_exit(&m_ring);
+		}
+
+		/**
+		 * \brief arm a multishot receive on fd_, std::nullopt when it isn't supported. Received bytes are handed over on executor_
+		 */
+		[[nodiscard]] std::optional<MultishotStream> subscribe(const asio::any_io_executor& executor_, int fd_) noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			if (!m_supported)
+				return std::nullopt;
+
+			auto subscription = std::make_shared<MultishotSubscription>(executor_, ++m_last_id, fd_);
+			if (!arm(*subscription) || io_uring_submit(&m_ring) < 0)
+				return std::nullopt;
+			m_subscriptions.emplace(subscription->id, subscription);
+			return std::optional<MultishotStream>{ std::in_place, *this, std::move(subscription) };
+		}
+
+		/**
+		 * \brief cancel the receive of subscription_, a read waiting on it completes with asio::error::operation_aborted
+		 */
+		void unsubscribe(const std::shared_ptr<MultishotSubscription>& subscription_) noexcept
+		{
+			{
+				std::unique_lock lock{ m_mutex };
+				if (m_subscriptions.erase(subscription_->id))
+				{
+					if (const auto sqe = next_sqe())
+					{
+						io_uring_prep_cancel64(sqe, subscription_->id, 0);
+						io_uring_sqe_set_data64(sqe, cancel_id);
+						io_uring_submit(&m_ring);
+					}
+				}
+			}
+			// Connections are closed from other event loops as well
+			asio::post(subscription_->wakeup.get_executor(), [subscription_] { subscription_->end(asio::error::operation_aborted); });
+		}
+
+	private:
+		void shutdown() override
+		{
+			asio::error_code ec;
+			m_signal.close(ec);
+		}
+
+		void wait() noexcept
+		{
+			m_signal.async_wait(asio::posix::stream_descriptor::wait_read, [this](const asio::error_code& ec_)
+			{
+				if (ec_)
+					return;
+				reap();
+				wait();
+			});
+		}
+
+		/**
+		 * \brief hand every completion to its subscription and put the buffers back, receives that ended for lack of buffers are armed again
+		 */
+		void reap() noexcept
+		{
+			// Before reaping, completions posted meanwhile signal the eventfd again
+			eventfd_t count;
+			::eventfd_read(m_signal.native_handle(), &count);
+
+			std::unique_lock lock{ m_mutex };
+			bool rearmed{};
+			unsigned head;
+			unsigned seen{};
+			io_uring_cqe* cqe;
+			io_uring_for_each_cqe(&m_ring, head, cqe)
+			{
+				++seen;
+				rearmed |= complete(*cqe);
+			}
+			io_uring_cq_advance(&m_ring, seen);
+			if (rearmed)
+				io_uring_submit(&m_ring);
+		}
+
+		/**
+		 * \return true when the receive was armed again
+		 */
+		bool complete(const io_uring_cqe& cqe_) noexcept
+		{
+			const auto found = m_subscriptions.find(io_uring_cqe_get_data64(&cqe_));
+			MultishotSubscription* subscription = found != m_subscriptions.end() ? found->second.get() : nullptr;
+			if (cqe_.flags & IORING_CQE_F_BUFFER)
+			{
+				const auto index = static_cast<u16>(cqe_.flags >> IORING_CQE_BUFFER_SHIFT);
+				if (subscription && cqe_.res > 0)
+					subscription->deliver(std::span{ m_storage }.subspan(index * m_buffer_size, static_cast<usize>(cqe_.res)));
+				recycle(index);
+			}
+			// Cancelled or still armed
+			if (!subscription || (cqe_.flags & IORING_CQE_F_MORE))
+				return false;
+
+			// Ran out of buffers or stopped after data, the receive ended but the socket is fine
+			if (cqe_.res > 0 || cqe_.res == -ENOBUFS)
+				return arm(*subscription);
+
+			if (cqe_.res == -EINVAL)
+			{
+				spdlog::warn("Kernel has no multishot receive, connections read the socket themselves");
+				m_supported = false;
+				subscription->end(asio::error::operation_not_supported);
+			}
+			else
+				subscription->end(cqe_.res == 0 ? asio::error::eof : asio::error_code{ -cqe_.res, asio::error::get_system_category() });
+			m_subscriptions.erase(found);
+			return false;
+		}
+
+		bool arm(const MultishotSubscription& subscription_) noexcept
+		{
+			const auto sqe = next_sqe();
+			if (!sqe)
+				return false;
+			io_uring_prep_recv_multishot(sqe, subscription_.fd, nullptr, 0, 0);
+			sqe->flags |= IOSQE_BUFFER_SELECT;
+			sqe->buf_group = buffer_group;
+			io_uring_sqe_set_data64(sqe, subscription_.id);
+			return true;
+		}
+
+		io_uring_sqe* next_sqe() noexcept
+		{
+			if (const auto sqe = io_uring_get_sqe(&m_ring))
+				return sqe;
+			// Submission queue is full, flush it and try again
+			io_uring_submit(&m_ring);
+			return io_uring_get_sqe(&m_ring);
+		}
+
+		void recycle(u16 index_) noexcept
+		{
+			io_uring_buf_ring_add(m_buffers, m_storage.data() + index_ * m_buffer_size, static_cast<unsigned>(m_buffer_size), index_, io_uring_buf_ring_mask(static_cast<u32>(m_buffer_count)), 0);
+			io_uring_buf_ring_advance(m_buffers, 1);
+		}
+
+		static void fail(const char* what_, int error_) noexcept
+		{
+			spdlog::warn("Multishot receive failed on {}, fallback to normal reads: {}", what_, std::error_code{error_, std::system_category()}.message());
+		}
+
+	private:
+		static inline constexpr unsigned queue_entries = 256;
+		static inline constexpr usize max_buffer_count = 32768;
+		static inline constexpr u16 buffer_group = 0;
+		static inline constexpr u64 cancel_id = 0;	// Subscription ids start from 1
+
+		std::mutex m_mutex;	// Streams are released from other event loops too
+		io_uring m_ring{};
+		bool m_ring_ready{};
+		bool m_supported{};
+		usize m_buffer_count;
+		usize m_buffer_size;
+		io_uring_buf_ring* m_buffers{};
+		std::vector<u8> m_storage;
+		asio::posix::stream_descriptor m_signal;	// eventfd registered on m_ring
+		u64 m_last_id{};
+		std::unordered_map<u64, std::shared_ptr<MultishotSubscription>> m_subscriptions;
+	};
+
+	void MultishotStream::release() noexcept
+	{
+		if (const auto owner = std::exchange(m_owner, nullptr))
+			owner->unsubscribe(m_subscription);
+	}
+}
+#endif
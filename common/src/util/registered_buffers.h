@@ -0,0 +1,151 @@
+#pragma once
+#include "asio.h"
+
+#ifdef AR_HAS_IO_URING
+#include <mutex>
+#include <span>
+#include <vector>
+#include <optional>
+#include <asio/buffer_registration.hpp>
+#include <asio/execution_context.hpp>
+#include <asio/registered_buffer.hpp>
+#include <spdlog/spdlog.h>
+
+#include "types.h"
+
+namespace ar
+{
+	class RegisteredBuffers;
+
+	/**
+	 * \brief receive slot of a single connection, the slot goes back to the event loop when destroyed
+	 */
+	class RegisteredSlot
+	{
+	public:
+		RegisteredSlot(RegisteredBuffers& owner_, usize index_, std::span<u8> memory_, asio::mutable_registered_buffer buffer_) noexcept
+			: m_owner{&owner_}, m_index{index_}, m_memory{memory_}, m_buffer{buffer_}
+		{
+		}
+
+		RegisteredSlot(const RegisteredSlot& other) = delete;
+		RegisteredSlot& operator=(const RegisteredSlot& other) = delete;
+
+		RegisteredSlot(RegisteredSlot&& other) noexcept
+			: m_owner{std::exchange(other.m_owner, nullptr)}, m_index{other.m_index}, m_memory{other.m_memory}, m_buffer{other.m_buffer}
+		{
+		}
+
+		RegisteredSlot& operator=(RegisteredSlot&& other) noexcept
+		{
+			if (this == &other)
+				return *this;
+			release();
+			m_owner = std::exchange(other.m_owner, nullptr);
+			m_index = other.m_index;
+			m_memory = other.m_memory;
+			m_buffer = other.m_buffer;
+			return *this;
+		}
+
+		~RegisteredSlot() noexcept
+		{
+			release();
+		}
+
+		[[nodiscard]] std::span<u8> memory() const noexcept { return m_memory; }
+
+		/**
+		 * \brief registered view of region_, std::nullopt when region_ is not inside this slot
+		 */
+		[[nodiscard]] std::optional<asio::mutable_registered_buffer> buffer(std::span<u8> region_) const noexcept
+		{
+			if (region_.data() < m_memory.data() || region_.data() + region_.size() > m_memory.data() + m_memory.size())
+				return std::nullopt;
+			return asio::buffer(m_buffer + static_cast<usize>(region_.data() - m_memory.data()), region_.size());
+		}
+
+	private:
+		inline void release() noexcept;
+
+	private:
+		RegisteredBuffers* m_owner;
+		usize m_index;
+		std::span<u8> m_memory;
+		asio::mutable_registered_buffer m_buffer;
+	};
+
+	/**
+	 * \brief receive slab registered once on the io_uring of an event loop and split into fixed slots for the connections living on it.
+	 * Reads into a slot are submitted as fixed buffer reads, so the kernel doesn't map the user pages again on every read.
+	 * Installed with asio::make_service, connections on an event loop without it simply read into their own buffer
+	 */
+	class RegisteredBuffers : public asio::execution_context::service
+	{
+	public:
+		using key_type = RegisteredBuffers;
+		static inline asio::execution_context::id id{};
+
+		explicit RegisteredBuffers(asio::execution_context& context_, usize slot_count_ = 0, usize slot_size_ = 0)
+			: asio::execution_context::service{context_}, m_slot_size{slot_size_}, m_storage(slot_count_ * slot_size_)
+		{
+			if (m_storage.empty())
+				return;
+
+			// Single region, io_uring limits the count of registered buffers but not the size of each of them
+			try
+			{
+				m_registration.emplace(asio::register_buffers(context_, std::vector<asio::mutable_buffer>{ asio::buffer(m_storage) }));
+			}
+			catch (const asio::system_error& e)
+			{
+				spdlog::warn("Failed to register receive buffers, fallback to normal reads: {}", e.what());
+				return;
+			}
+
+			m_free_slots.reserve(slot_count_);
+			for (usize i = slot_count_; i > 0; --i)
+				m_free_slots.push_back(i - 1);
+		}
+
+		/**
+		 * \brief take a free slot, std::nullopt when every slot is taken
+		 */
+		[[nodiscard]] std::optional<RegisteredSlot> acquire() noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			if (m_free_slots.empty())
+				return std::nullopt;
+
+			const auto index = m_free_slots.back();
+			m_free_slots.pop_back();
+			const auto offset = index * m_slot_size;
+			return std::optional<RegisteredSlot>{ std::in_place, *this, index, std::span{ m_storage }.subspan(offset, m_slot_size), *m_registration->begin() + offset };
+		}
+
+		void release(usize index_) noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			m_free_slots.push_back(index_);
+		}
+
+	private:
+		void shutdown() override
+		{
+		}
+
+	private:
+		std::mutex m_mutex;	// Slots are taken and returned on connect and disconnect only
+		usize m_slot_size;
+		std::vector<u8> m_storage;
+		std::vector<usize> m_free_slots;
+		std::optional<asio::buffer_registration<std::vector<asio::mutable_buffer>>> m_registration;
+	};
+
+	void RegisteredSlot::release() noexcept
+	{
+		if (const auto owner = std::exchange(m_owner, nullptr))
+			owner->release(m_index);
+	}
+}
+#endif
@@ -0,0 +1,254 @@
+#pragma once
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <unordered_map>
+
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/elgamal.h>
+#include <cryptopp/secblock.h>
+
+#include "types.h"
+#include "util.h"
+#include "buffer_pool.h"
+
+namespace ar
+{
+	enum class SealedKind : u8
+	{
+		Sealed,				// Session key was already announced to the recipient
+		SealedWithKey,		// Session key wrapped for the recipient precedes the nonce
+		KeyRequest,			// Recipient doesn't have the session key of key id, the next sealed payload carries it again
+	};
+
+	// Payload: +####@@...$$$$$$$$$$$$...%%%%%%%%%%%%%%%%
+	// +: SealedKind
+	// #: key id
+	// @: wrapped key length, SealedWithKey only
+	// ...: session key encrypted with the ElGamal public key of the recipient, SealedWithKey only
+	// $: nonce
+	// ...: ciphertext
+	// %: tag
+	/**
+	 * \brief AES-GCM session key per peer and direction. Sender picks the key on its first payload to a peer and wraps it once with the ElGamal
+	 * public key of the peer, so ElGamal only runs once per peer on either side and payloads have no size limit.
+	 * Header of the payload is authenticated along with it. Safe to use from several threads
+	 */
+	class SessionCipher
+	{
+	public:
+		using peer_id = u32;
+		using key_id = u32;
+
+		static inline constexpr usize key_size = 32;
+		static inline constexpr usize nonce_size = 12;
+		static inline constexpr usize tag_size = 16;
+
+		/**
+		 * \brief encrypt plain_ for peer_, encryptor_ of the peer is only used to wrap the session key the first time.
+		 * The lock is only held to look the key up, wrapping and encrypting run outside of it
+		 */
+		byte_buffer seal(cry::RandomNumberGenerator& rng_, peer_id peer_, const cry::ElGamal::Encryptor& encryptor_, std::span<const u8> plain_) noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			auto it = m_send.find(peer_);
+			if (it == m_send.end())
+			{
+				lock.unlock();
+				auto fresh = make_send_key(rng_, encryptor_);
+				lock.lock();
+				// Another thread may have wrapped one meanwhile, the first one stays
+				it = m_send.try_emplace(peer_, std::move(fresh)).first;
+			}
+			auto& key = it->second;
+
+			const auto with_key = !key.announced;
+			const auto header_size = sizeof(SealedKind) + sizeof(key_id) + (with_key ? sizeof(u16) + key.wrapped.size() : 0);
+			byte_buffer result(header_size + nonce_size + plain_.size() + tag_size);
+
+			auto out = result.data();
+			*out++ = static_cast<u8>(with_key ? SealedKind::SealedWithKey : SealedKind::Sealed);
+			std::memcpy(out, &key.id, sizeof(key_id));
+			out += sizeof(key_id);
+			if (with_key)
+			{
+				const auto wrapped_size = static_cast<u16>(key.wrapped.size());
+				std::memcpy(out, &wrapped_size, sizeof(u16));
+				std::memcpy(out + sizeof(u16), key.wrapped.data(), key.wrapped.size());
+				out += sizeof(u16) + key.wrapped.size();
+			}
+			key.announced = true;
+			const cry::SecByteBlock session_key{ key.key.data(), key.key.size() };
+			lock.unlock();
+
+			const auto nonce = out;
+			rng_.GenerateBlock(nonce, nonce_size);
+			out += nonce_size;
+
+			cry::GCM<cry::AES>::Encryption encryption;
+			encryption.SetKeyWithIV(session_key.data(), session_key.size(), nonce, nonce_size);
+			encryption.EncryptAndAuthenticate(out, out + plain_.size(), tag_size, nonce, nonce_size, result.data(), header_size, plain_.data(), plain_.size());
+			return result;
+		}
+
+		/**
+		 * \brief decrypt payload of peer_, wrapped session key is unwrapped with decryptor_ only when it changes. The lock is only held to
+		 * look the key up and to store a new one, unwrapping and decrypting run outside of it
+		 * \return std::nullopt when the payload is malformed, forged or sealed with a session key this side doesn't have, see key_request
+		 */
+		std::optional<byte_buffer> open(cry::RandomNumberGenerator& rng_, peer_id peer_, const cry::ElGamal::Decryptor& decryptor_, std::span<const u8> sealed_) noexcept
+		{
+			if (sealed_.size() < sizeof(SealedKind) + sizeof(key_id))
+				return std::nullopt;
+			const auto kind = static_cast<SealedKind>(sealed_[0]);
+			key_id id;
+			std::memcpy(&id, sealed_.data() + sizeof(SealedKind), sizeof(key_id));
+
+			auto header_size = sizeof(SealedKind) + sizeof(key_id);
+			std::span<const u8> wrapped{};
+			if (kind == SealedKind::SealedWithKey)
+			{
+				u16 wrapped_size;
+				if (sealed_.size() < header_size + sizeof(u16))
+					return std::nullopt;
+				std::memcpy(&wrapped_size, sealed_.data() + header_size, sizeof(u16));
+				if (sealed_.size() < header_size + sizeof(u16) + wrapped_size)
+					return std::nullopt;
+				wrapped = sealed_.subspan(header_size + sizeof(u16), wrapped_size);
+				header_size += sizeof(u16) + wrapped_size;
+			}
+			else if (kind != SealedKind::Sealed)
+				return std::nullopt;
+
+			if (sealed_.size() < header_size + nonce_size + tag_size)
+				return std::nullopt;
+
+			cry::SecByteBlock session_key{};
+			{
+				std::unique_lock lock{ m_mutex };
+				const auto it = m_receive.find(peer_);
+				if (it != m_receive.end() && it->second.id == id)
+					session_key = cry::SecByteBlock{ it->second.key.data(), it->second.key.size() };
+			}
+
+			const auto unwrapped = session_key.size() == 0;
+			if (unwrapped)
+			{
+				if (wrapped.empty() || wrapped.size() != decryptor_.CiphertextLength(key_size))
+					return std::nullopt;
+				const auto key = ::ar::decrypt(rng_, decryptor_, wrapped);
+				if (key.size() != key_size)
+					return std::nullopt;
+				session_key = cry::SecByteBlock{ key.data(), key.size() };
+			}
+
+			const auto nonce = sealed_.subspan(header_size, nonce_size);
+			const auto cipher = sealed_.subspan(header_size + nonce_size, sealed_.size() - header_size - nonce_size - tag_size);
+			const auto tag = sealed_.last(tag_size);
+
+			byte_buffer plain(cipher.size());
+			cry::GCM<cry::AES>::Decryption decryption;
+			decryption.SetKeyWithIV(session_key.data(), session_key.size(), nonce.data(), nonce_size);
+			if (!decryption.DecryptAndVerify(plain.data(), tag.data(), tag_size, nonce.data(), nonce_size, sealed_.data(), header_size, cipher.data(), cipher.size()))
+				return std::nullopt;
+
+			// Only a key that opened its payload replaces the one stored, unless another thread stored this one meanwhile
+			if (unwrapped)
+			{
+				std::unique_lock lock{ m_mutex };
+				const auto it = m_receive.find(peer_);
+				if (it == m_receive.end() || it->second.id != id)
+					m_receive.insert_or_assign(peer_, ReceiveKey{ id, std::move(session_key) });
+			}
+			return plain;
+		}
+
+		/**
+		 * \brief payload to send back to the peer when open failed because the announcement of the session key never came (dropped while parked)
+		 */
+		std::optional<byte_buffer> key_request(peer_id peer_, std::span<const u8> sealed_) noexcept
+		{
+			if (sealed_.size() < sizeof(SealedKind) + sizeof(key_id) || static_cast<SealedKind>(sealed_[0]) != SealedKind::Sealed)
+				return std::nullopt;
+			key_id id;
+			std::memcpy(&id, sealed_.data() + sizeof(SealedKind), sizeof(key_id));
+
+			{
+				std::unique_lock lock{ m_mutex };
+				const auto it = m_receive.find(peer_);
+				if (it != m_receive.end() && it->second.id == id)
+					return std::nullopt;
+			}
+
+			byte_buffer result(sizeof(SealedKind) + sizeof(key_id));
+			result[0] = static_cast<u8>(SealedKind::KeyRequest);
+			std::memcpy(result.data() + sizeof(SealedKind), &id, sizeof(key_id));
+			return result;
+		}
+
+		/**
+		 * \brief announce the session key again on the next payload to peer_ when sealed_ is a key request for it
+		 * \return false when sealed_ isn't a key request
+		 */
+		bool on_key_request(peer_id peer_, std::span<const u8> sealed_) noexcept
+		{
+			if (sealed_.size() < sizeof(SealedKind) + sizeof(key_id) || static_cast<SealedKind>(sealed_[0]) != SealedKind::KeyRequest)
+				return false;
+			key_id id;
+			std::memcpy(&id, sealed_.data() + sizeof(SealedKind), sizeof(key_id));
+
+			std::unique_lock lock{ m_mutex };
+			const auto it = m_send.find(peer_);
+			if (it != m_send.end() && it->second.id == id)
+				it->second.announced = false;
+			return true;
+		}
+
+		// Peer is gone, its id may come back with another key pair
+		void forget(peer_id peer_) noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			m_send.erase(peer_);
+			m_receive.erase(peer_);
+		}
+
+		// Key pair of this side changed, or the peers may have
+		void clear() noexcept
+		{
+			std::unique_lock lock{ m_mutex };
+			m_send.clear();
+			m_receive.clear();
+		}
+
+	private:
+		struct SendKey
+		{
+			key_id id;
+			cry::SecByteBlock key;
+			std::vector<u8> wrapped;
+			bool announced;
+		};
+
+		struct ReceiveKey
+		{
+			key_id id;
+			cry::SecByteBlock key;
+		};
+
+		static SendKey make_send_key(cry::RandomNumberGenerator& rng_, const cry::ElGamal::Encryptor& encryptor_) noexcept
+		{
+			SendKey key{ {}, cry::SecByteBlock{ key_size }, {}, false };
+			rng_.GenerateBlock(reinterpret_cast<u8*>(&key.id), sizeof(key_id));
+			rng_.GenerateBlock(key.key.data(), key.key.size());
+			key.wrapped = ::ar::encrypt(rng_, encryptor_, std::span<const u8>{ key.key.data(), key.key.size() });
+			return key;
+		}
+
+	private:
+		std::mutex m_mutex;
+		std::unordered_map<peer_id, SendKey> m_send;
+		std::unordered_map<peer_id, ReceiveKey> m_receive;
+	};
+}
@@ -0,0 +1,340 @@
+#pragma once
+#include "asio.h"
+
+#ifdef AR_HAS_SHM_RING
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/bind_cancellation_slot.hpp>
+#include <asio/cancellation_signal.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+#include <spdlog/spdlog.h>
+
+#include "types.h"
+
+namespace ar
+{
+	/**
+	 * \brief single producer single consumer byte ring shared by two processes on the same host. The producer writes the same frames it would write to a socket
+	 * and the consumer reads them into its FrameDecoder, so nothing but memory copies happen while both sides keep up.
+	 * Each direction has an eventfd that is only written when the other side announced it is sleeping on an empty or full ring
+	 */
+	class ShmRing
+	{
+		// Positions only grow, the offset on the ring is position & (capacity - 1)
+		struct Header
+		{
+			alignas(64) std::atomic<u64> head;	// Consumer position
+			alignas(64) std::atomic<u64> tail;	// Producer position
+			alignas(64) std::atomic<u32> consumer_waiting;
+			std::atomic<u32> producer_waiting;
+			std::atomic<u32> closed;
+		};
+		static_assert(std::atomic<u64>::is_always_lock_free && std::atomic<u32>::is_always_lock_free, "Header is shared by two processes");
+
+		static constexpr usize fd_count = 3;	// memfd, readable eventfd, writable eventfd
+
+	public:
+		static constexpr usize header_size = sizeof(Header);
+
+		ShmRing(const ShmRing& other) = delete;
+		ShmRing& operator=(const ShmRing& other) = delete;
+
+		ShmRing(ShmRing&& other) noexcept
+			: m_memfd{std::exchange(other.m_memfd, -1)}, m_header{std::exchange(other.m_header, nullptr)}, m_data{other.m_data}, m_capacity{other.m_capacity},
+			  m_position{other.m_position}, m_readable{std::move(other.m_readable)}, m_writable{std::move(other.m_writable)}
+		{
+		}
+
+		ShmRing& operator=(ShmRing&& other) noexcept
+		{
+			if (this == &other)
+				return *this;
+			release();
+			m_memfd = std::exchange(other.m_memfd, -1);
+			m_header = std::exchange(other.m_header, nullptr);
+			m_data = other.m_data;
+			m_capacity = other.m_capacity;
+			m_position = other.m_position;
+			m_readable = std::move(other.m_readable);
+			m_writable = std::move(other.m_writable);
+			return *this;
+		}
+
+		~ShmRing() noexcept
+		{
+			release();
+		}
+
+		/**
+		 * \brief new ring of at least capacity_ bytes for the producer, on a memfd sealed against resizing so the consumer can map it safely
+		 */
+		static std::optional<ShmRing> create(const asio::any_io_executor& executor_, usize capacity_) noexcept
+		{
+			const auto capacity = std::bit_ceil(std::max<usize>(capacity_, 4096));
+			const auto size = header_size + capacity;
+
+			const int memfd = ::memfd_create("chatty-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+			if (memfd < 0)
+				return fail("memfd_create");
+			if (::ftruncate(memfd, static_cast<off_t>(size)) < 0 || ::fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+			{
+				::close(memfd);
+				return fail("sizing ring");
+			}
+
+			const int readable = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			const int writable = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			return map(executor_, memfd, readable, writable, size, true);
+		}
+
+		/**
+		 * \brief map the ring of the producer, the fds are owned by the ring even when it fails.
+		 * std::nullopt when the memfd isn't sealed against shrinking or its ring is bigger than max_capacity_
+		 */
+		static std::optional<ShmRing> attach(const asio::any_io_executor& executor_, int memfd_, int readable_, int writable_, usize max_capacity_) noexcept
+		{
+			struct stat st{};
+			const auto seals = ::fcntl(memfd_, F_GET_SEALS);
+			const bool valid = ::fstat(memfd_, &st) == 0 && seals >= 0 && (seals & F_SEAL_SHRINK)
+				&& static_cast<usize>(st.st_size) > header_size && std::has_single_bit(static_cast<usize>(st.st_size) - header_size)
+				&& static_cast<usize>(st.st_size) - header_size <= max_capacity_;
+			if (!valid)
+			{
+				spdlog::warn("Shared memory ring of the peer is not a sealed ring of at most {} bytes", max_capacity_);
+				for (const auto fd : { memfd_, readable_, writable_ })
+				{
+					if (fd >= 0)
+						::close(fd);
+				}
+				return std::nullopt;
+			}
+			return map(executor_, memfd_, readable_, writable_, static_cast<usize>(st.st_size), false);
+		}
+
+		/**
+		 * \brief pass the ring to the consumer over an AF_UNIX socket, as a single byte that should be the first thing sent on it
+		 */
+		bool send_to(int socket_) noexcept
+		{
+			const int fds[fd_count]{ m_memfd, m_readable.native_handle(), m_writable.native_handle() };
+			u8 byte{};
+			iovec iov{ &byte, 1 };
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))]{};
+
+			msghdr msg{};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			const auto cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+			std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+			if (::sendmsg(socket_, &msg, MSG_NOSIGNAL) != 1)
+			{
+				fail("sending ring");
+				return false;
+			}
+			return true;
+		}
+
+		/**
+		 * \brief receive the ring that send_to passed on socket_, should only be called once the socket is readable
+		 */
+		static std::optional<ShmRing> receive_from(const asio::any_io_executor& executor_, int socket_, usize max_capacity_) noexcept
+		{
+			int fds[fd_count]{ -1, -1, -1 };
+			u8 byte{};
+			iovec iov{ &byte, 1 };
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))]{};
+
+			msghdr msg{};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (::recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != 1)
+				return fail("receiving ring");
+
+			const auto cmsg = CMSG_FIRSTHDR(&msg);
+			if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+				std::memcpy(fds, CMSG_DATA(cmsg), std::min<usize>(cmsg->cmsg_len - CMSG_LEN(0), sizeof(fds)));
+			return attach(executor_, fds[0], fds[1], fds[2], max_capacity_);
+		}
+
+		/**
+		 * \brief producer side, copy as much of data_ as fits and wake the consumer when it sleeps
+		 * \return bytes written, 0 when the ring is full or closed
+		 */
+		usize write(std::span<const u8> data_) noexcept
+		{
+			const auto used = m_position - m_header->head.load(std::memory_order_acquire);
+			if (used > m_capacity || m_header->closed.load(std::memory_order_relaxed))
+				return 0;
+
+			const auto size = std::min<usize>(m_capacity - used, data_.size());
+			const auto offset = m_position & (m_capacity - 1);
+			const auto first = std::min(size, m_capacity - offset);
+			std::memcpy(m_data + offset, data_.data(), first);
+			std::memcpy(m_data, data_.data() + first, size - first);
+			m_position += size;
+
+			// Sequentially consistent against consumer_waiting, so either the consumer sees the data or the producer sees it waiting
+			m_header->tail.store(m_position);
+			if (size && m_header->consumer_waiting.load())
+				signal(m_readable);
+			return size;
+		}
+
+		/**
+		 * \brief consumer side, copy what is available into buffer_ and wake the producer when it sleeps
+		 * \return bytes read, std::nullopt when the producer corrupted the positions
+		 */
+		std::optional<usize> read(std::span<u8> buffer_) noexcept
+		{
+			const auto available = m_header->tail.load(std::memory_order_acquire) - m_position;
+			if (available > m_capacity)
+				return std::nullopt;
+
+			const auto size = std::min<usize>(available, buffer_.size());
+			const auto offset = m_position & (m_capacity - 1);
+			const auto first = std::min(size, m_capacity - offset);
+			std::memcpy(buffer_.data(), m_data + offset, first);
+			std::memcpy(buffer_.data() + first, m_data, size - first);
+			m_position += size;
+
+			m_header->head.store(m_position);
+			if (size && m_header->producer_waiting.load())
+				signal(m_writable);
+			return size;
+		}
+
+		/**
+		 * \brief consumer side, wait until the producer writes anything
+		 * \return asio::error::eof once the ring is closed by either side
+		 */
+		asio::awaitable<asio::error_code> wait_readable(asio::cancellation_slot slot_) noexcept
+		{
+			co_return co_await wait(m_header->consumer_waiting, m_readable, slot_, [this] { return m_header->tail.load() != m_position; });
+		}
+
+		/**
+		 * \brief producer side, wait until the consumer frees anything
+		 * \return asio::error::eof once the ring is closed by either side
+		 */
+		asio::awaitable<asio::error_code> wait_writable(asio::cancellation_slot slot_) noexcept
+		{
+			co_return co_await wait(m_header->producer_waiting, m_writable, slot_, [this] { return m_position - m_header->head.load() < m_capacity; });
+		}
+
+		/**
+		 * \brief mark the ring closed and wake both sides, the memory stays mapped until the ring is destroyed
+		 */
+		void close() noexcept
+		{
+			if (!m_header || m_header->closed.exchange(1))
+				return;
+			signal(m_readable);
+			signal(m_writable);
+		}
+
+		[[nodiscard]] usize capacity() const noexcept { return m_capacity; }
+
+	private:
+		ShmRing(const asio::any_io_executor& executor_, int memfd_, Header* header_, usize capacity_, int readable_, int writable_) noexcept
+			: m_memfd{memfd_}, m_header{header_}, m_data{reinterpret_cast<u8*>(header_) + header_size}, m_capacity{capacity_},
+			  m_position{}, m_readable{executor_, readable_}, m_writable{executor_, writable_}
+		{
+		}
+
+		static std::optional<ShmRing> map(const asio::any_io_executor& executor_, int memfd_, int readable_, int writable_, usize size_, bool producer_) noexcept
+		{
+			void* memory = readable_ < 0 || writable_ < 0 ? MAP_FAILED : ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+			if (memory == MAP_FAILED)
+			{
+				fail("mapping ring");
+				for (const auto fd : { memfd_, readable_, writable_ })
+				{
+					if (fd >= 0)
+						::close(fd);
+				}
+				return std::nullopt;
+			}
+
+			// Memory of a new memfd is zeroed, which is an empty open ring
+			const auto header = producer_ ? std::construct_at(static_cast<Header*>(memory)) : std::launder(static_cast<Header*>(memory));
+			std::optional<ShmRing> ring{ ShmRing{executor_, memfd_, header, size_ - header_size, readable_, writable_} };
+			ring->m_position = producer_ ? header->tail.load() : header->head.load();
+			return ring;
+		}
+
+		template<typename Ready>
+		asio::awaitable<asio::error_code> wait(std::atomic<u32>& waiting_, asio::posix::stream_descriptor& signal_, asio::cancellation_slot slot_, Ready ready_) noexcept
+		{
+			asio::error_code ec;
+			// Announce the wait before checking again, the other side checks the flag after publishing
+			waiting_.store(1);
+			if (!ready_() && !m_header->closed.load())
+				co_await signal_.async_wait(asio::posix::stream_descriptor::wait_read, asio::bind_cancellation_slot(slot_, asio::redirect_error(asio::use_awaitable, ec)));
+			waiting_.store(0);
+
+			eventfd_t count;
+			::eventfd_read(signal_.native_handle(), &count);
+			if (!ec && m_header->closed.load() && !ready_())
+				ec = asio::error::eof;
+			co_return ec;
+		}
+
+		static void signal(asio::posix::stream_descriptor& signal_) noexcept
+		{
+			if (signal_.is_open())
+				::eventfd_write(signal_.native_handle(), 1);
+		}
+
+		static std::nullopt_t fail(const char* what_) noexcept
+		{
+			spdlog::warn("Shared memory ring failed on {}: {}", what_, std::error_code{errno, std::system_category()}.message());
+			return std::nullopt;
+		}
+
+		void release() noexcept
+		{
+			if (!m_header)
+				return;
+			close();
+			::munmap(m_header, header_size + m_capacity);
+			::close(m_memfd);
+			m_header = nullptr;
+		}
+
+	private:
+		int m_memfd;
+		Header* m_header;
+		u8* m_data;
+		usize m_capacity;
+		u64 m_position;		// Own side position, the one on the header is only published for the other side
+		asio::posix::stream_descriptor m_readable;	// Written by the producer
+		asio::posix::stream_descriptor m_writable;	// Written by the consumer
+	};
+}
+#endif
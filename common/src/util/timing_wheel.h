@@ -0,0 +1,274 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <asio/execution_context.hpp>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+#include "types.h"
+
+namespace ar
+{
+	class TimingWheel;
+
+	/**
+	 * \brief intrusive node of TimingWheel, arm and cancel only relink the node so they never allocate
+	 */
+	class WheelTimer
+	{
+		friend class TimingWheel;
+	public:
+		using callback_type = std::function<void()>;
+
+		// Sentinel of a slot list
+		WheelTimer() noexcept : m_wheel{}, m_prev{this}, m_next{this}, m_expiry{}
+		{
+		}
+
+		WheelTimer(TimingWheel& wheel_, callback_type&& callback_) noexcept
+			: m_wheel{&wheel_}, m_prev{this}, m_next{this}, m_expiry{}, m_callback{std::move(callback_)}
+		{
+		}
+
+		// Linked into the wheel by address
+		WheelTimer(const WheelTimer& other) = delete;
+		WheelTimer& operator=(const WheelTimer& other) = delete;
+
+		~WheelTimer() noexcept
+		{
+			cancel();
+		}
+
+		/**
+		 * \brief (re)arm the timer, callback is called on the event loop of the wheel once timeout_ passed
+		 */
+		inline void arm(std::chrono::milliseconds timeout_) noexcept;
+
+		inline void cancel() noexcept;
+
+		[[nodiscard]] bool is_armed() const noexcept { return m_next != this; }
+		[[nodiscard]] TimingWheel& wheel() const noexcept { return *m_wheel; }
+
+	private:
+		void unlink() noexcept
+		{
+			m_prev->m_next = m_next;
+			m_next->m_prev = m_prev;
+			m_prev = m_next = this;
+		}
+
+		void link_before(WheelTimer& node_) noexcept
+		{
+			m_prev = node_.m_prev;
+			m_next = &node_;
+			node_.m_prev->m_next = this;
+			node_.m_prev = this;
+		}
+
+	private:
+		TimingWheel* m_wheel;
+		WheelTimer* m_prev;
+		WheelTimer* m_next;
+		u64 m_expiry;	// Absolute tick
+		callback_type m_callback;
+	};
+
+	/**
+	 * \brief hierarchical timing wheel shared by every connection of an event loop (handshake, authentication and idle deadlines).
+	 * Each level has 64 slots of 64 times the span of the level below, so arm and cancel are O(1) and the event loop only has a single steady_timer ticking while anything is armed.
+	 * Installed lazily with asio::use_service on the io_context, every method should be called from that event loop
+	 */
+	class TimingWheel : public asio::execution_context::service
+	{
+		friend class WheelTimer;
+	public:
+		using key_type = TimingWheel;
+		static inline asio::execution_context::id id{};
+
+		static constexpr std::chrono::milliseconds resolution{ 100 };
+		static constexpr usize slot_bits = 6;
+		static constexpr usize slot_count = 1 << slot_bits;
+		// 64^4 ticks of 100ms is about 19 days, longer deadlines are parked on the last level until they are in range
+		static constexpr usize level_count = 4;
+
+		explicit TimingWheel(asio::io_context& context_)
+			: asio::execution_context::service{context_}, m_timer{context_}, m_start{clock_type::now()}, m_now{}, m_armed{}, m_ticking{}
+		{
+		}
+
+		static TimingWheel& of(asio::io_context& context_) noexcept
+		{
+			return asio::use_service<TimingWheel>(context_);
+		}
+
+		// Wheel of the io_context that runs executor_
+		template<typename Executor>
+		static TimingWheel& of(const Executor& executor_) noexcept
+		{
+			return of(static_cast<asio::io_context&>(asio::query(executor_, asio::execution::context)));
+		}
+
+		[[nodiscard]] usize armed() const noexcept { return m_armed; }
+
+	private:
+		using clock_type = std::chrono::steady_clock;
+
+		void shutdown() override
+		{
+			for (auto& level : m_slots)
+			{
+				for (auto& slot : level)
+				{
+					while (slot.is_armed())
+						slot.m_next->unlink();
+				}
+			}
+			m_armed = 0;
+			m_timer.cancel();
+		}
+
+		void arm(WheelTimer& timer_, std::chrono::milliseconds timeout_) noexcept
+		{
+			if (timer_.is_armed())
+				timer_.unlink();
+			else
+				++m_armed;
+
+			// Idle wheel can jump straight to the current tick, nothing is armed to expire on the way
+			if (m_armed == 1)
+				m_now = current_tick();
+
+			const auto ticks = std::max<u64>(1, (timeout_ + resolution - std::chrono::milliseconds{ 1 }) / resolution);
+			timer_.m_expiry = m_now + ticks;
+			insert(timer_);
+
+			if (!m_ticking)
+				schedule();
+		}
+
+		void cancel(WheelTimer& timer_) noexcept
+		{
+			if (!timer_.is_armed())
+				return;
+			timer_.unlink();
+			--m_armed;
+		}
+
+		// Level is the highest 6 bits group where the expiry differs from now, the node is cascaded down once now reaches that group
+		void insert(WheelTimer& timer_) noexcept
+		{
+			constexpr usize top = level_count - 1;
+			const auto diff = timer_.m_expiry ^ m_now;
+			const auto level = diff ? static_cast<usize>(std::bit_width(diff) - 1) / slot_bits : 0;
+			if (level < level_count)
+			{
+				timer_.link_before(m_slots[level][(timer_.m_expiry >> (slot_bits * level)) & (slot_count - 1)]);
+				return;
+			}
+
+			// Last level wraps around, in range expiry is still reached before its slot comes again
+			if (timer_.m_expiry - m_now < u64{ 1 } << (slot_bits * level_count))
+			{
+				timer_.link_before(m_slots[top][(timer_.m_expiry >> (slot_bits * top)) & (slot_count - 1)]);
+				return;
+			}
+
+			// Out of range, parked on the slot that comes last and re-evaluated from there
+			timer_.link_before(m_slots[top][((m_now >> (slot_bits * top)) - 1) & (slot_count - 1)]);
+		}
+
+		void schedule() noexcept
+		{
+			m_ticking = true;
+			m_timer.expires_at(m_start + resolution * (m_now + 1));
+			m_timer.async_wait([this](const asio::error_code& ec_)
+			{
+				m_ticking = false;
+				if (ec_)
+					return;
+
+				// Catch up when the event loop was busy for more than a tick
+				const auto target = current_tick();
+				while (m_armed && m_now < target)
+					advance();
+
+				if (m_armed)
+					schedule();
+			});
+		}
+
+		void advance() noexcept
+		{
+			++m_now;
+
+			// Cascade every level whose lower groups just turned around, highest first
+			usize levels = 1;
+			while (levels < level_count && !(m_now & ((u64{ 1 } << (slot_bits * levels)) - 1)))
+				++levels;
+			for (usize level = levels - 1; level > 0; --level)
+			{
+				WheelTimer pending{};
+				splice(m_slots[level][(m_now >> (slot_bits * level)) & (slot_count - 1)], pending);
+				while (pending.is_armed())
+				{
+					auto& timer = *pending.m_next;
+					timer.unlink();
+					insert(timer);
+				}
+			}
+
+			// Callback may arm or cancel other timers, so take the slot out first
+			WheelTimer expired{};
+			splice(m_slots[0][m_now & (slot_count - 1)], expired);
+			while (expired.is_armed())
+			{
+				auto& timer = *expired.m_next;
+				timer.unlink();
+				--m_armed;
+				timer.m_callback();
+			}
+		}
+
+		static void splice(WheelTimer& from_, WheelTimer& to_) noexcept
+		{
+			if (!from_.is_armed())
+				return;
+			to_.m_next = from_.m_next;
+			to_.m_prev = from_.m_prev;
+			to_.m_next->m_prev = &to_;
+			to_.m_prev->m_next = &to_;
+			from_.m_prev = from_.m_next = &from_;
+		}
+
+		u64 current_tick() const noexcept
+		{
+			return static_cast<u64>((clock_type::now() - m_start) / resolution);
+		}
+
+	private:
+		asio::steady_timer m_timer;
+		clock_type::time_point m_start;
+		u64 m_now;		// Ticks since m_start that are already processed
+		usize m_armed;
+		bool m_ticking;
+		std::array<std::array<WheelTimer, slot_count>, level_count> m_slots;
+	};
+
+	void WheelTimer::arm(std::chrono::milliseconds timeout_) noexcept
+	{
+		m_wheel->arm(*this, timeout_);
+	}
+
+	void WheelTimer::cancel() noexcept
+	{
+		// Wheel unlinks everything on shutdown, so a timer outliving its io_context never touches it
+		if (!is_armed())
+			return;
+		if (m_wheel)
+			m_wheel->cancel(*this);
+		else
+			unlink();
+	}
+}
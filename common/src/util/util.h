@@ -3,11 +3,21 @@
 #include <type_traits>
 #include <span>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include <cryptopp/elgamal.h>
 #include <cryptopp/cryptlib.h>
 
 #include "types.h"
+#include "key_config.h"
 
 namespace cry = ::CryptoPP;
 
@@ -66,10 +76,14 @@ namespace ar
 		return plain_;
 	}
 
-	static cry::ElGamal::PrivateKey generate_private_key(cry::RandomNumberGenerator& rng_)
+	static cry::ElGamal::PrivateKey generate_private_key(cry::RandomNumberGenerator& rng_, const KeyConfig& config_ = {})
 	{
 		cry::ElGamal::PrivateKey private_key{};
-		private_key.GenerateRandomWithKeySize(rng_, 512);
+		const auto group = config_.group == KeyGroup::Fixed ? fixed_group(config_.key_size) : nullptr;
+		if (group)
+			private_key.Initialize(rng_, group->modulus, group->generator);
+		else
+			private_key.GenerateRandomWithKeySize(rng_, config_.key_size);
 		return private_key;
 	}
 
@@ -80,16 +94,26 @@ namespace ar
 		return public_key;
 	}
 
-	static std::tuple<cry::ElGamal::PrivateKey, cry::ElGamal::PublicKey> generate_keys(cry::RandomNumberGenerator& rng_)
+	static std::tuple<cry::ElGamal::PrivateKey, cry::ElGamal::PublicKey> generate_keys(cry::RandomNumberGenerator& rng_, const KeyConfig& config_ = {})
 	{
-		cry::ElGamal::PrivateKey private_key;
+		auto private_key = generate_private_key(rng_, config_);
 		cry::ElGamal::PublicKey public_key;
-		private_key.GenerateRandomWithKeySize(rng_, 512);
 		private_key.MakePublicKey(public_key);
 
 		return std::make_tuple(std::move(private_key), std::move(public_key));
 	}
 
+	/**
+	 * \brief encryptor of public_key_ with fixed base tables for the generator and the public element, worth keeping around for a peer
+	 * that is encrypted to more than once. Tables are only read afterwards, so it can be shared by several threads
+	 */
+	static cry::ElGamal::Encryptor make_encryptor(const cry::ElGamal::PublicKey& public_key_)
+	{
+		cry::ElGamal::Encryptor encryptor{ public_key_ };
+		encryptor.AccessKey().Precompute();
+		return encryptor;
+	}
+
 	static std::vector<u8> encrypt(cry::RandomNumberGenerator& rng_, const cry::ElGamal::Encryptor& encryptor_, std::string_view plain_text_) noexcept
 	{
 		const auto cipher_len = encryptor_.CiphertextLength(plain_text_.size());
@@ -132,6 +156,109 @@ namespace ar
 		return key;
 	}
 
+	/**
+	 * \brief whether key_ is a sound key generate_private_key could have made with config_. A key of another size or of the other
+	 * KeyGroup counts as a changed config, it should be replaced. Level 3 validation tests the group for primality as well, so it
+	 * belongs on a thread that may take its time
+	 */
+	static bool matches_config(cry::RandomNumberGenerator& rng_, const cry::ElGamal::PrivateKey& key_, const KeyConfig& config_) noexcept
+	{
+		const auto& params = key_.GetGroupParameters();
+		if (params.GetModulus().BitCount() != config_.key_size)
+			return false;
+
+		// Sizes without a fixed group are always generated with a random one
+		const auto group = fixed_group(config_.key_size);
+		const auto wants_fixed = config_.group == KeyGroup::Fixed && group;
+		const auto is_fixed = group && params.GetModulus() == group->modulus && params.GetSubgroupGenerator() == group->generator;
+		if (wants_fixed != is_fixed)
+			return false;
+
+		return key_.Validate(rng_, 3);
+	}
+
+	namespace detail
+	{
+		// Create temp_ for the owner only and write bytes_ to it durably, temp_ is removed again on any failure
+		inline bool write_private_file(const std::filesystem::path& temp_, std::span<const u8> bytes_) noexcept
+		{
+			std::error_code ec;
+			// Leftover of a crashed save, the exclusive create below would fail on it forever
+			std::filesystem::remove(temp_, ec);
+#ifndef _WIN32
+			// Mode is applied on creation, there is never a moment anyone else can open it
+			const auto fd = ::open(temp_.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+			if (fd < 0)
+				return false;
+
+			auto ok = true;
+			for (auto rest = bytes_; ok && !rest.empty();)
+			{
+				const auto written = ::write(fd, rest.data(), rest.size());
+				if (written < 0 && errno == EINTR)
+					continue;
+				ok = written > 0;
+				if (ok)
+					rest = rest.subspan(static_cast<usize>(written));
+			}
+			// On disk before the rename makes it the key
+			ok = ok && ::fsync(fd) == 0;
+			ok = ::close(fd) == 0 && ok;
+#else
+			// Files are created with the ACL of the directory here, the mode bits don't apply
+			std::ofstream file{ temp_, std::ios::binary | std::ios::trunc };
+			file.write(reinterpret_cast<const char*>(bytes_.data()), static_cast<std::streamsize>(bytes_.size()));
+			const auto ok = static_cast<bool>(file.flush());
+			file.close();
+#endif
+			if (!ok)
+				std::filesystem::remove(temp_, ec);
+			return ok;
+		}
+	}
+
+	/**
+	 * \brief write private key to path_, readable and writable by the owner only. Written next to it first and renamed over it,
+	 * so a crash never leaves half a key behind at path_ and a failed save leaves nothing next to it
+	 */
+	static bool save_private_key(const std::filesystem::path& path_, const cry::ElGamal::PrivateKey& key_) noexcept
+	{
+		std::vector<u8> output;
+		key_.Save(cry::VectorSink{output}.Ref());
+
+		auto temp = path_;
+		temp += ".tmp";
+		if (!detail::write_private_file(temp, output))
+			return false;
+
+		std::error_code ec;
+		std::filesystem::rename(temp, path_, ec);
+		if (!ec)
+			return true;
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+
+	// std::nullopt when path_ doesn't exist or doesn't hold a private key
+	static std::optional<cry::ElGamal::PrivateKey> load_private_key(const std::filesystem::path& path_) noexcept
+	{
+		std::ifstream file{ path_, std::ios::binary };
+		if (!file)
+			return std::nullopt;
+		const std::vector<u8> input{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+
+		cry::ElGamal::PrivateKey key{};
+		try
+		{
+			key.Load(cry::VectorSource{ input, true }.Ref());
+		}
+		catch (const cry::Exception&)
+		{
+			return std::nullopt;
+		}
+		return key;
+	}
+
 	inline std::string get_current_time() noexcept
 	{
 		auto time = std::chrono::current_zone()->to_local(std::chrono::system_clock::now());
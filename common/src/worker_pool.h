@@ -0,0 +1,146 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <cryptopp/osrng.h>
+
+#include "util/types.h"
+
+namespace ar
+{
+	namespace cry = ::CryptoPP;
+
+	// Sums of every worker of a WorkerPool
+	struct WorkerMetrics
+	{
+		u64 submitted;
+		u64 rejected;		// Dropped because the worker was full
+		u64 completed;
+		usize depth;		// Queued or running right now
+		usize peak_depth;	// Highest depth a single worker reached
+	};
+
+	/**
+	 * \brief bounded pool for CPU heavy work (decryption, key parsing, key generation), so the event loops only do I/O and routing.
+	 * Every worker runs its own io_context on its own thread and owns a random pool, jobs get the one of the worker they run on.
+	 * Jobs submitted with the same key run on the same worker in submission order, a job posts its result back to the executor it belongs to
+	 */
+	class WorkerPool
+	{
+	public:
+		using rng_type = cry::AutoSeededRandomPool;
+		using work_guard_type = asio::executor_work_guard<asio::io_context::executor_type>;
+
+		/**
+		 * \brief max_depth_ is the count of jobs a single worker may have queued or running, submit fails above it
+		 */
+		WorkerPool(usize worker_count_, usize max_depth_) : m_max_depth{max_depth_}, m_stopped{false}
+		{
+			m_workers.reserve(std::max<usize>(worker_count_, 1));
+			for (usize i = 0; i < std::max<usize>(worker_count_, 1); ++i)
+			{
+				auto& worker = *m_workers.emplace_back(std::make_unique<Worker>());
+				worker.thread = std::thread{ [&worker] { worker.context.run(); } };
+			}
+		}
+
+		WorkerPool(const WorkerPool& other) = delete;
+		WorkerPool& operator=(const WorkerPool& other) = delete;
+
+		~WorkerPool() noexcept
+		{
+			stop();
+		}
+
+		/**
+		 * \brief run job_ with the random pool of the worker of key_
+		 * \return false when that worker is full or stopped, job_ is dropped then
+		 */
+		template<std::invocable<rng_type&> F>
+		bool submit(usize key_, F&& job_) noexcept
+		{
+			if (m_stopped.load(std::memory_order_acquire))
+				return false;
+			auto& worker = *m_workers[key_ % m_workers.size()];
+
+			const auto depth = worker.depth.fetch_add(1, std::memory_order_relaxed) + 1;
+			if (depth > m_max_depth)
+			{
+				worker.depth.fetch_sub(1, std::memory_order_relaxed);
+				worker.rejected.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			worker.submitted.fetch_add(1, std::memory_order_relaxed);
+
+			auto peak = worker.peak_depth.load(std::memory_order_relaxed);
+			while (peak < depth && !worker.peak_depth.compare_exchange_weak(peak, depth, std::memory_order_relaxed))
+			{
+			}
+
+			asio::post(worker.context, [&worker, job = std::forward<F>(job_)]() mutable
+			{
+				job(worker.rng);
+				worker.completed.fetch_add(1, std::memory_order_relaxed);
+				worker.depth.fetch_sub(1, std::memory_order_relaxed);
+			});
+			return true;
+		}
+
+		// Queued jobs still run, submit fails afterwards
+		void stop() noexcept
+		{
+			if (m_stopped.exchange(true, std::memory_order_acq_rel))
+				return;
+			for (auto& worker : m_workers)
+				worker->guard.reset();
+
+			for (auto& worker : m_workers)
+			{
+				if (worker->thread.joinable())
+					worker->thread.join();
+			}
+		}
+
+		[[nodiscard]] WorkerMetrics metrics() const noexcept
+		{
+			WorkerMetrics result{};
+			for (const auto& worker : m_workers)
+			{
+				result.submitted += worker->submitted.load(std::memory_order_relaxed);
+				result.rejected += worker->rejected.load(std::memory_order_relaxed);
+				result.completed += worker->completed.load(std::memory_order_relaxed);
+				result.depth += worker->depth.load(std::memory_order_relaxed);
+				result.peak_depth = std::max(result.peak_depth, worker->peak_depth.load(std::memory_order_relaxed));
+			}
+			return result;
+		}
+
+		[[nodiscard]] usize size() const noexcept { return m_workers.size(); }
+
+	private:
+		struct Worker
+		{
+			asio::io_context context{ 1 };
+			work_guard_type guard{ context.get_executor() };
+			std::thread thread;
+			rng_type rng{};		// Only used by thread
+
+			std::atomic<usize> depth{};
+			std::atomic<usize> peak_depth{};
+			std::atomic<u64> submitted{};
+			std::atomic<u64> rejected{};
+			std::atomic<u64> completed{};
+		};
+
+	private:
+		usize m_max_depth;
+		std::atomic<bool> m_stopped;
+		std::vector<std::unique_ptr<Worker>> m_workers;		// Pointers, running threads keep the address of their worker
+	};
+}
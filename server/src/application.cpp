@@ -4,9 +4,19 @@
 
 namespace ar
 {
-	application::application(u16 port_)
+	application::application(u16 port_, std::string_view local_socket_, std::string_view ring_socket_)
 		: m_server{{asio::ip::tcp::v4(), port_}}
 	{
+		if (local_socket_.empty() && ring_socket_.empty())
+			return;
+#ifdef AR_HAS_LOCAL_SOCKETS
+		if (!local_socket_.empty())
+			m_server.listen(asio::local::stream_protocol::endpoint{ local_socket_ });
+		if (!ring_socket_.empty())
+			m_server.listen(asio::local::stream_protocol::endpoint{ ring_socket_ }, true);
+#else
+		spdlog::warn("Local sockets are not supported on this platform, ignoring {} {}", local_socket_, ring_socket_);
+#endif
 	}
 
 	void application::start()
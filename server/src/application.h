@@ -1,4 +1,6 @@
 ﻿#pragma once
+#include <string_view>
+
 #include "simple_server.h"
 
 namespace ar
@@ -8,7 +10,8 @@ namespace ar
 	class application
 	{
 	public:
-		explicit application(u16 port_);
+		// local_socket_ is the path of an additional AF_UNIX listener, ring_socket_ the path of the one for shared memory ring producers. Empty ones are not opened
+		explicit application(u16 port_, std::string_view local_socket_ = {}, std::string_view ring_socket_ = {});
 
 		void start();
 
@@ -17,74 +17,126 @@ namespace ar
 		return manager;
 	}
 
-	void ConnectionManager::start_validation(Connection<ConnectionType::Server>& conn_) noexcept
+	asio::awaitable<bool> ConnectionManager::handshake(connection_type& conn_) noexcept
 	{
 		// Send challenge
 		const auto number = generate_random_numbers<usize>();
-		m_users[conn_.id()].key = number;
-		const ValidationMessage val_msg{number};
+		{
+			std::unique_lock lock{ m_mutex };
+			m_users[conn_.id()].key = number;
+		}
+		// Client that speaks a newer framing answers with a Version frame first, connection answers it before the handshake sees it
+		const ValidationMessage val_msg{number, max_wire_version};
 		conn_.send(val_msg);
 
 		// Wait for answer
-		// conn_.read_timed(std::chrono::milliseconds::zero());
-		conn_.read_once();
-	}
+		Message msg{};
+		if (!co_await conn_.read_message(msg, VALIDATION_TIMEOUT))
+		{
+			co_await reject<FeedbackType::ValidationFailed>(conn_);
+			co_return false;
+		}
 
-	void ConnectionManager::validate(Connection<ConnectionType::Server>& conn_, const Message& msg_) noexcept
-	{
-		auto number = m_users[conn_.id()].key;
-		number = encrypt_xor(number, KEY);
+		switch (msg.type())
+		{
+		// Answer and authentication in one flight, reply once
+		case MessageType::Handshake:
+		{
+			auto handshake = msg.body_as<HandshakeMessage>();
+			if (!validate(conn_, handshake.challenge))
+			{
+				co_await reject<FeedbackType::ValidationFailed>(conn_);
+				co_return false;
+			}
+			if (!authenticate(conn_, std::move(handshake.authenticate)))
+			{
+				co_await reject<FeedbackType::AuthenticationFailed>(conn_);
+				co_return false;
+			}
+			// Queued right behind the feedback, so both go out on the same write
+			conn_.send(online_list(conn_.id()));
+			co_return true;
+		}
+		// Reconnect within the grace period takes the previous session over without authenticating again
+		case MessageType::Resume:
+		{
+			const auto resume = msg.body_as<ResumeMessage>();
+			if (!validate(conn_, resume.challenge))
+			{
+				co_await reject<FeedbackType::ValidationFailed>(conn_);
+				co_return false;
+			}
+			if (resume_session(conn_, resume.session))
+				co_return true;
+			send_feedback<FeedbackType::ResumeFailed>(conn_);
+			break;
+		}
+		case MessageType::Validation:
+		{
+			if (!validate(conn_, msg.body_as<ValidationMessage>().challenge))
+			{
+				co_await reject<FeedbackType::ValidationFailed>(conn_);
+				co_return false;
+			}
+			send_feedback<FeedbackType::ValidationSucceed>(conn_);
+			break;
+		}
+		default:
+			co_await reject<FeedbackType::ValidationFailed>(conn_);
+			co_return false;
+		}
 
-		const auto message = msg_.body_as<ValidationMessage>();
-		const bool result = message.challenge == number;
-		if (!result)
+		if (!co_await conn_.read_message(msg, AUTHENTICATION_TIMEOUT) || msg.type() != MessageType::Authenticate || !authenticate(conn_, msg.body_as<AuthenticateMessage>()))
 		{
-			send_feedback<FeedbackType::ValidationFailed>(conn_);
-			remove_connection(conn_, true);
-			return;
+			// TODO: Instead of reject the connection, server can ask another username
+			co_await reject<FeedbackType::AuthenticationFailed>(conn_);
+			co_return false;
 		}
+		co_return true;
+	}
 
-		send_feedback<FeedbackType::ValidationSucceed>(conn_);
+	bool ConnectionManager::validate(connection_type& conn_, u64 answer_) noexcept
+	{
+		u64 number;
+		{
+			std::shared_lock lock{ m_mutex };
+			const auto it = m_users.find(conn_.id());
+			if (it == m_users.end())
+				return false;
+			number = encrypt_xor(it->second.key, KEY);
+		}
 
-		// spdlog::info("[{}] Accepted Connection", conn_.id());
-		conn_.read_once([this](connection_type& conn_, const Message& msg_)
-			{
-				authenticate(conn_, msg_);
-			});
+		return answer_ == number;
 	}
 
-	void ConnectionManager::authenticate(Connection<ConnectionType::Server>& conn_, const Message& msg_) noexcept
+	bool ConnectionManager::authenticate(connection_type& conn_, AuthenticateMessage&& msg_) noexcept
 	{
 		// Do authentication?
-		auto msg = msg_.body_as<AuthenticateMessage>();
-		if (!is_unique(msg.username))
+		auto msg = std::move(msg_);
+		const auto id = conn_.id();
+		const NewUserMessage new_user_message{ id, msg.username };
 		{
-			send_feedback<FeedbackType::AuthenticationFailed>(conn_);
-			// TODO: Instead of reject the connection, server can ask another username
-			remove_connection(conn_, true);
-			return;
+			// Check and claim the username at once, so two event loops can't take the same name
+			std::unique_lock lock{ m_mutex };
+			if (!is_unique(msg.username))
+				return false;
+			m_users[id].name = std::move(msg.username);
+			m_users[id].public_key = std::move(msg.public_key);
 		}
 		send_feedback<FeedbackType::AuthenticationSucceed>(conn_);
+		issue_session(conn_);
 
-		const auto id = conn_.id();
-		spdlog::info("User logged in {}:{}", id, msg.username);
-
-		const NewUserMessage new_user_message{ id, msg.username };
-		m_users[id].name = std::move(msg.username);
-		m_users[id].public_key = std::move(msg.public_key);
+		spdlog::info("User logged in {}:{}", id, new_user_message.name);
 
 		// Send to all connections that there is new user connected
-		for (const auto conn : m_connections | std::ranges::views::filter([=](connection_ptr conn_) { return conn_->id() != id; }))
-		{
-			conn->send(new_user_message);
-		}
-
-		conn_.start();
+		broadcast(new_user_message, id);
+		return true;
 	}
 
-	ConnectionManager::connection_ptr ConnectionManager::add_connection(asio::ip::tcp::socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_) noexcept
+	ConnectionManager::connection_ptr ConnectionManager::add_connection(stream_socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_, const ConnectionConfig& config_) noexcept
 	{
-		auto temp = new connection_type{ ++s_current_id, std::forward<asio::ip::tcp::socket>(socket_), message_handler_, *this };
+		auto temp = std::make_shared<connection_type>(++s_current_id, std::move(socket_), message_handler_, *this, config_);
+		std::unique_lock lock{ m_mutex };
 		m_connections.emplace_back(temp);
 		return temp;
 	}
@@ -99,6 +151,15 @@ namespace ar
 		// TODO: bool reject_ can use template instead
 		const auto id = conn_.id();
 
+		// User stays online for a while, nobody is told unless the session expires
+		if (!reject_ && detach_session(conn_))
+		{
+			std::unique_lock lock{ m_mutex };
+			std::erase_if(m_connections, [&](const connection_ptr& conn2_) { return conn2_.get() == &conn_; });
+			spdlog::info("Client {} dropped, keeping its session for {}s", id, SESSION_GRACE.count());
+			return;
+		}
+
 		if (!reject_)
 		{
 			// Send to all connections that this id is disconnected
@@ -107,7 +168,8 @@ namespace ar
 		}
 
 		// Remove connection
-		if (std::erase_if(m_connections, [=](connection_ptr conn2_) { return conn2_->id() == id; }))
+		std::unique_lock lock{ m_mutex };
+		if (std::erase_if(m_connections, [=](const connection_ptr& conn2_) { return conn2_->id() == id; }))
 		{
 			spdlog::info("Client {} disconnected", id);
 			m_users.erase(id);
@@ -116,24 +178,183 @@ namespace ar
 
 	ConnectionManager::connection_ptr ConnectionManager::connection(connection_type::id_type id_) noexcept
 	{
-		const auto conn = std::ranges::find_if(m_connections, [&](const connection_ptr conn2_) { return conn2_->id() == id_; });
+		std::shared_lock lock{ m_mutex };
+		const auto conn = std::ranges::find_if(m_connections, [&](const connection_ptr& conn2_) { return conn2_->id() == id_; });
 
 		if (conn == m_connections.end())
 			return nullptr;
 		return *conn;
 	}
 
-	std::span<ConnectionManager::connection_ptr> ConnectionManager::connections() noexcept
+	std::vector<ConnectionManager::connection_ptr> ConnectionManager::connections() noexcept
 	{
+		std::shared_lock lock{ m_mutex };
 		return m_connections;
 	}
 
-	ptr<User> ConnectionManager::user(connection_type::id_type id_) noexcept
+	void ConnectionManager::clear_connections() noexcept
+	{
+		connection_container connections{};
+		{
+			std::unique_lock lock{ m_mutex };
+			connections.swap(m_connections);
+		}
+		// Freed outside of the lock
+		connections.clear();
+	}
+
+	std::optional<User> ConnectionManager::user(connection_type::id_type id_) noexcept
 	{
+		std::shared_lock lock{ m_mutex };
 		const auto it = m_users.find(id_);
 		if (it == m_users.end())
-			return {};
-		return &it->second;
+			return std::nullopt;
+		return it->second;
+	}
+
+	OnlineListMessage ConnectionManager::online_list(connection_type::id_type exception_) noexcept
+	{
+		OnlineListMessage::user_container container{};
+		{
+			std::shared_lock lock{ m_mutex };
+			for (const auto& [id, user] : m_users)
+			{
+				// Users without name are still in the handshake
+				if (id == exception_ || user.name.empty())
+					continue;
+				container.emplace_back(id, user.name);
+			}
+		}
+		return OnlineListMessage{ CommandType::OnlineList, std::move(container) };
+	}
+
+	bool ConnectionManager::park(connection_type::id_type id_, shared_frame frame_) noexcept
+	{
+		std::unique_lock lock{ m_mutex };
+		const auto it = m_sessions.find(id_);
+		if (it == m_sessions.end() || !it->second.detached)
+			return false;
+
+		auto& session = it->second;
+		if (session.overflowed)
+			return true;
+		// Missed too much, the client rather authenticates again and rebuilds its state
+		if (session.pending.size() >= SESSION_PENDING_LIMIT)
+		{
+			session.overflowed = true;
+			session.pending.clear();
+			return true;
+		}
+		session.pending.emplace_back(std::move(frame_));
+		return true;
+	}
+
+	void ConnectionManager::park_all(const shared_frame& frame_, connection_type::id_type exception_) noexcept
+	{
+		std::vector<connection_type::id_type> detached{};
+		{
+			std::shared_lock lock{ m_mutex };
+			for (const auto& [id, session] : m_sessions)
+			{
+				if (session.detached && id != exception_)
+					detached.emplace_back(id);
+			}
+		}
+
+		for (const auto id : detached)
+			park(id, frame_);
+	}
+
+	SessionMessage::token_type ConnectionManager::generate_token() noexcept
+	{
+		SessionMessage::token_type token{};
+		m_token_rng.GenerateBlock(token.data(), token.size());
+		return token;
+	}
+
+	void ConnectionManager::issue_session(connection_type& conn_) noexcept
+	{
+		SessionMessage session_msg{ conn_.id(), {} };
+		{
+			std::unique_lock lock{ m_mutex };
+			auto& session = m_sessions[conn_.id()];
+			session.token = session_msg.token = generate_token();
+			session.detached = false;
+			session.overflowed = false;
+			session.pending.clear();
+		}
+		conn_.send(session_msg);
+	}
+
+	bool ConnectionManager::resume_session(connection_type& conn_, const SessionMessage& session_) noexcept
+	{
+		std::deque<shared_frame> pending{};
+		{
+			std::unique_lock lock{ m_mutex };
+			const auto it = m_sessions.find(session_.id);
+			if (it == m_sessions.end() || !it->second.detached || it->second.overflowed)
+				return false;
+
+			// Compare every byte, so the time doesn't tell how much of the token is right
+			u8 diff = 0;
+			for (usize i = 0; i < session_.token.size(); ++i)
+				diff |= session_.token[i] ^ it->second.token[i];
+			if (diff)
+				return false;
+
+			// Connection takes the id of the session over, the entry made for its challenge goes away
+			m_users.erase(conn_.id());
+			conn_.id(session_.id);
+			it->second.detached = false;
+			pending = std::move(it->second.pending);
+			it->second.pending.clear();
+		}
+
+		send_feedback<FeedbackType::AuthenticationSucceed>(conn_);
+		issue_session(conn_);
+		for (auto& frame : pending)
+			conn_.send(std::move(frame));
+
+		spdlog::info("User resumed {} with {} pending frames", session_.id, pending.size());
+		return true;
+	}
+
+	bool ConnectionManager::detach_session(connection_type& conn_) noexcept
+	{
+		const auto id = conn_.id();
+		u64 generation;
+		{
+			std::unique_lock lock{ m_mutex };
+			const auto it = m_sessions.find(id);
+			if (it == m_sessions.end() || it->second.detached)
+				return false;
+			it->second.detached = true;
+			generation = ++it->second.generation;
+		}
+
+		// Sessions can be resumed on any event loop, so the timer is never cancelled. It checks the generation instead
+		const auto timer = std::make_shared<asio::steady_timer>(conn_.socket().get_executor(), SESSION_GRACE);
+		timer->async_wait([this, timer, id, generation](const asio::error_code&)
+		{
+			expire_session(id, generation);
+		});
+		return true;
+	}
+
+	void ConnectionManager::expire_session(connection_type::id_type id_, u64 generation_) noexcept
+	{
+		{
+			std::unique_lock lock{ m_mutex };
+			const auto it = m_sessions.find(id_);
+			if (it == m_sessions.end() || !it->second.detached || it->second.generation != generation_)
+				return;
+			m_sessions.erase(it);
+			m_users.erase(id_);
+		}
+
+		spdlog::info("Session of {} expired", id_);
+		const UserDisconnectMessage dc_message{ id_ };
+		broadcast(dc_message, id_);
 	}
 
 	bool ConnectionManager::is_unique(std::string_view username_) const noexcept
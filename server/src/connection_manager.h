@@ -1,17 +1,38 @@
 ﻿#pragma once
 #include <ranges>
 #include <atomic>
+#include <deque>
+#include <shared_mutex>
+#include <optional>
+#include <cryptopp/osrng.h>
 
 #include "connection.h"
+#include "message/command.h"
 #include "user.h"
 #include "util/literal.h"
 
 namespace ar
 {
+	/**
+	 * \brief connections live on different event loops, every access of the containers is guarded by m_mutex
+	 */
 	class ConnectionManager : public IConnectionHandler
 	{
-		using connection_container = std::vector<connection_type*>;
+		/**
+		 * \brief kept for every authenticated user, so a reconnect within SESSION_GRACE takes the same id over instead of announcing a new user
+		 */
+		struct Session
+		{
+			SessionMessage::token_type token;
+			bool detached;		// Connection is gone, the user still looks online until the grace timer fires
+			bool overflowed;	// More than SESSION_PENDING_LIMIT frames were missed, the session can't be resumed anymore
+			u64 generation;		// Bumped on every detach, so the grace timer of an earlier detach doesn't expire a resumed session
+			std::deque<shared_frame> pending;	// Frames for the user while it is detached
+		};
+
+		using connection_container = std::vector<connection_ptr>;
 		using user_container = std::unordered_map<connection_type::id_type, User>;
+		using session_container = std::unordered_map<connection_type::id_type, Session>;
 	private:
 		ConnectionManager();
 
@@ -19,35 +40,75 @@ namespace ar
 		static ref<ConnectionManager> get();
 		~ConnectionManager() override = default;
 
-		void start_validation(Connection<ConnectionType::Server>& conn_) noexcept override;
-		void validate(Connection<ConnectionType::Server>& conn_, const Message& msg_) noexcept override;
-		void authenticate(Connection<ConnectionType::Server>& conn_, const Message& msg_) noexcept;
+		asio::awaitable<bool> handshake(connection_type& conn_) noexcept override;
 
-		connection_ptr add_connection(asio::ip::tcp::socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_) noexcept override;
+		connection_ptr add_connection(stream_socket&& socket_, ref<IMessageHandler<ConnectionType::Server>> message_handler_, const ConnectionConfig& config_) noexcept override;
 		void remove_connection(connection_type& conn_) noexcept override;
 
 		void remove_connection(connection_type& conn_, bool reject_) noexcept;
 
 		connection_ptr connection(connection_type::id_type id_) noexcept override;
-		std::span<connection_ptr> connections() noexcept override;
+		std::vector<connection_ptr> connections() noexcept override;
+		void clear_connections() noexcept override;
+
+		// Returns copy, the entry can be erased by another event loop
+		std::optional<User> user(connection_type::id_type id_) noexcept;
+
+		// Every authenticated user except exception_
+		OnlineListMessage online_list(connection_type::id_type exception_) noexcept;
 
-		ptr<User> user(connection_type::id_type id_) noexcept;
+		/**
+		 * \brief keep frame_ for a user whose connection is gone but whose session can still be resumed
+		 * \return false when there is no such session
+		 */
+		bool park(connection_type::id_type id_, shared_frame frame_) noexcept;
 
 	private:
+		// Check the answer of the challenge
+		bool validate(connection_type& conn_, u64 answer_) noexcept;
+		// Claim the username and announce the new user
+		bool authenticate(connection_type& conn_, AuthenticateMessage&& msg_) noexcept;
+
+		// Caller should hold m_mutex
 		bool is_unique(std::string_view username_) const noexcept;
+		// Caller should hold m_mutex
+		SessionMessage::token_type generate_token() noexcept;
+
+		// Send a new session token to an authenticated connection
+		void issue_session(connection_type& conn_) noexcept;
+		// Move conn_ onto a detached session, pending frames are sent right after the feedback
+		bool resume_session(connection_type& conn_, const SessionMessage& session_) noexcept;
+		// Keep the user of conn_ for SESSION_GRACE, false when conn_ has no session
+		bool detach_session(connection_type& conn_) noexcept;
+		void expire_session(connection_type::id_type id_, u64 generation_) noexcept;
+		// Park frame_ for every detached session except exception_
+		void park_all(const shared_frame& frame_, connection_type::id_type exception_) noexcept;
 
 		template<FeedbackType Type>
 		void send_feedback(connection_type& conn_) noexcept;
 
+		// Flush the failed feedback then drop the connection, rejected connection is never announced
+		template<FeedbackType Type>
+		asio::awaitable<void> reject(connection_type& conn_) noexcept;
+
 		template<Serializable T>
 		void broadcast(const T& msg_, connection_type::id_type exception_) noexcept;
 
 	private:
+		mutable std::shared_mutex m_mutex;
 		connection_container m_connections;
 		user_container m_users;
+		session_container m_sessions;
+		cry::AutoSeededRandomPool m_token_rng;	// Guarded by m_mutex as well
 
 		static inline std::atomic<connection_type::id_type> s_current_id{};
 		constexpr static inline std::string_view KEY = "n1odah10"sv;
+		constexpr static inline std::chrono::seconds VALIDATION_TIMEOUT{ 10 };
+		// Username is typed by the user, so it can take a while
+		constexpr static inline std::chrono::minutes AUTHENTICATION_TIMEOUT{ 10 };
+		// How long a dropped user stays online for a resumption and how many frames are kept for it meanwhile
+		constexpr static inline std::chrono::seconds SESSION_GRACE{ 30 };
+		constexpr static inline usize SESSION_PENDING_LIMIT = 256;
 	};
 
 	template <FeedbackType Type>
@@ -57,12 +118,25 @@ namespace ar
 		conn_.send(fed_msg);
 	}
 
+	template <FeedbackType Type>
+	asio::awaitable<void> ConnectionManager::reject(connection_type& conn_) noexcept
+	{
+		const FeedbackMessage fed_msg{ Type };
+		co_await conn_.async_send(fed_msg);
+		remove_connection(conn_, true);
+		if (conn_.is_connected())
+			conn_.socket().close();
+	}
+
 	template <Serializable T>
 	void ConnectionManager::broadcast(const T& msg_, connection_type::id_type exception_) noexcept
 	{
-		for (const auto conn : m_connections | std::ranges::views::filter([=](connection_ptr conn_) { return conn_->id() != exception_; }))
+		const auto frame = make_frame(msg_);
+		const auto conns = connections();
+		for (const auto& conn : conns | std::ranges::views::filter([=](const connection_ptr& conn_) { return conn_->id() != exception_; }))
 		{
-			conn->send(msg_);
+			conn->send(frame);
 		}
+		park_all(frame, exception_);
 	}
 }
@@ -1,8 +1,9 @@
 ﻿#include "application.h"
 
-int main()
+int main(int argc, char** argv)
 {
-	ar::application app{ 9696 };
+	// Optional paths of AF_UNIX sockets to listen on next to the TCP port, the second one is for shared memory ring producers
+	ar::application app{ 9696, argc > 1 ? argv[1] : "", argc > 2 ? argv[2] : "" };
 	app.start();
 	return 0;
 }
\ No newline at end of file
@@ -1,12 +1,29 @@
 ﻿#include "simple_server.h"
 
 #include "connection_manager.h"
+#include "message/view.h"
 
 namespace ar
 {
-	SimpleServer::SimpleServer(const asio::ip::tcp::endpoint& ep_)
-		: IServer{ ep_, ConnectionManager::get() }, m_connection_manager{ ConnectionManager::get() }, m_private_key{generate_private_key(m_rng)}, m_public_key{generate_public_key(m_private_key)}
+	SimpleServer::SimpleServer(const asio::ip::tcp::endpoint& ep_, const KeyConfig& key_config_)
+		: IServer{ ep_, ConnectionManager::get() }, m_connection_manager{ ConnectionManager::get() },
+		  m_crypto_workers{ CRYPTO_WORKERS, CRYPTO_QUEUE_LIMIT }
 	{
+		// Event loops aren't running yet, nothing waits for it
+		const auto start = std::chrono::steady_clock::now();
+		cry::AutoSeededRandomPool rng{};
+		const auto private_key = generate_private_key(rng, key_config_);
+		m_decryptor = cry::ElGamal::Decryptor{ private_key };
+		m_public_key = generate_public_key(private_key);
+		spdlog::info("Generated {} bit key pair in {} ms", key_config_.key_size,
+			std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	SimpleServer::~SimpleServer() noexcept
+	{
+		m_crypto_workers.stop();
+		const auto metrics = m_crypto_workers.metrics();
+		spdlog::info("Crypto workers: {} jobs done, {} dropped, peak queue depth {}", metrics.completed, metrics.rejected, metrics.peak_depth);
 	}
 
 	void SimpleServer::on_new_in_message(connection_type& conn_, const Message& message_) noexcept
@@ -15,22 +32,31 @@ namespace ar
 		{
 		case MessageType::Chat:
 		{
-			auto chat = message_.body_as<ChatMessage>();
+			const auto view = message_.view_as<ChatMessageView>();
+			if (!view)
+				break;
 
-			if (chat.opponent == ChatOpponent::Server)
+			if (view->opponent == ChatOpponent::Server)
 			{
-				chat.decrypt(m_rng, m_private_key);
-				spdlog::info("Chat: {} :: {}", conn_.id(), chat.message_str());
+				// Decryption works in place, this one needs an owned copy
+				open_chat(conn_, message_.body_as<ChatMessage>());
 				break;
 			}
 
-			const auto conn = m_connection_manager->connection(chat.opponent_id);
+			const auto opponent_id = view->opponent_id;
+			spdlog::info("Chat: [{}] -> [{}]", conn_.id(), opponent_id);
+
+			// Received bytes are forwarded as they are, only the opponent id is swapped for the sender
+			auto frame = make_patched_frame(message_, ChatMessageView::opponent_id_offset, conn_.id());
+
+			// Opponent that just dropped gets it once it resumes
+			const auto conn = m_connection_manager->connection(opponent_id);
 			if (!conn)
+			{
+				m_connection_manager->park(opponent_id, std::move(frame));
 				break;
-
-			spdlog::info("Chat: [{}] -> [{}]", conn_.id(), chat.opponent_id);
-			chat.opponent_id = conn_.id();
-			conn->send(chat);
+			}
+			conn->send(std::move(frame));
 			break;
 		}
 		case MessageType::Command:
@@ -40,21 +66,7 @@ namespace ar
 			{
 			case CommandType::OnlineList:
 			{
-				const auto conn_id = conn_.id();
-				OnlineListMessage::user_container container{};
-
-				for (const auto& conn : m_connection_manager->connections() | std::ranges::views::filter(
-					[=](const connection_type* conn2_) { return conn_id != conn2_->id(); }))
-				{
-					auto user = m_connection_manager->user(conn->id());
-					if (!user)
-						continue;
-
-					container.emplace_back(conn->id(), user->name);
-				}
-
-				const OnlineListMessage respond_msg{ CommandType::OnlineList, std::move(container) };
-				conn_.send(respond_msg);
+				conn_.send(m_connection_manager->online_list(conn_.id()));
 				break;
 			}
 			case CommandType::RequestPublicKey:
@@ -95,7 +107,7 @@ namespace ar
 					break;
 
 				const auto user = m_connection_manager->user(id);
-				if (user)
+				if (!user)
 					break;
 
 				const RequestUserPropertiesMessage respond_msg{
@@ -104,8 +116,42 @@ namespace ar
 				conn_.send(respond_msg);
 			}
 			}
+			break;
 		}
+		// Handshake, session and framing messages never reach the message handler, the rest isn't handled by the server
+		default:
+			break;
 		}
 	}
 
+	void SimpleServer::open_chat(connection_type& conn_, ChatMessage&& chat_) noexcept
+	{
+		const auto id = conn_.id();
+		// Session key belongs to the sender
+		chat_.opponent_id = id;
+
+		// Same worker for every chat of a connection, the one announcing a session key is opened before the ones sealed with it
+		const auto submitted = m_crypto_workers.submit(id, [this, id, chat = std::move(chat_), executor = conn_.socket().get_executor()](WorkerPool::rng_type& rng_) mutable
+		{
+			if (chat.decrypt(rng_, m_cipher, m_decryptor))
+			{
+				spdlog::info("Chat: {} :: {}", id, chat.message_str());
+				return;
+			}
+
+			spdlog::warn("Chat: {} :: can't be opened", id);
+			auto request = m_cipher.key_request(id, chat.message);
+			if (!request)
+				return;
+			// Connection may be gone by now, look it up again on its own event loop
+			asio::post(executor, [this, id, request = std::move(*request)]() mutable
+			{
+				if (const auto conn = m_connection_manager->connection(id))
+					conn->send(ChatMessage{ ChatOpponent::Server, 0, std::move(request) });
+			});
+		});
+		if (!submitted)
+			spdlog::warn("Chat: {} :: crypto workers are full, dropped", id);
+	}
+
 }
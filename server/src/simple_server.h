@@ -1,12 +1,12 @@
 ﻿#pragma once
 
 #include <asio.hpp>
-#include <cryptopp/osrng.h>
 #include <spdlog/spdlog.h>
 
 #include "connection.h"
 
 #include "server.h"
+#include "worker_pool.h"
 
 namespace ar
 {
@@ -15,7 +15,9 @@ namespace ar
 	class SimpleServer : public IServer
 	{
 	public:
-		SimpleServer(const asio::ip::tcp::endpoint& ep_);
+		// key_config_ picks the group of the key pair generated here, clients pick their own
+		SimpleServer(const asio::ip::tcp::endpoint& ep_, const KeyConfig& key_config_ = {});
+		~SimpleServer() noexcept override;
 
 		void on_new_in_message(connection_type& conn_, const Message& message_) noexcept override;
 		
@@ -24,13 +26,21 @@ namespace ar
 
 		bool on_new_connection(connection_type& conn_) noexcept override { return true; }
 
+		// Open a chat sent to the server on the crypto workers, a key request goes back on the event loop of conn_
+		void open_chat(connection_type& conn_, ChatMessage&& chat_) noexcept;
+
 	private:
 		ref<ConnectionManager> m_connection_manager;
 
-		cry::AutoSeededRandomPool m_rng{};
-
-		cry::ElGamal::PrivateKey m_private_key;
+		cry::ElGamal::Decryptor m_decryptor;		// Of the private key of the server, built once
 		cry::ElGamal::PublicKey m_public_key;
+		SessionCipher m_cipher;		// Session keys of the clients that chat with the server
+
+		// Last, so running jobs are joined before anything they use is gone
+		WorkerPool m_crypto_workers;
+
+		constexpr static inline usize CRYPTO_WORKERS = 2;
+		constexpr static inline usize CRYPTO_QUEUE_LIMIT = 1024;	// Per worker, server bound chats above it are dropped
 	};
 
 }
\ No newline at end of file
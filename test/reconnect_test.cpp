@@ -0,0 +1,107 @@
+﻿#include <atomic>
+#include <chrono>
+#include <thread>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "simple_client.h"
+
+extern char** environ;
+
+using namespace std::chrono_literals;
+
+namespace
+{
+	// Port the server executable listens on, see server/src/main.cpp
+	constexpr u16 SERVER_PORT = 9696;
+
+	/**
+	 * \brief accept and reset every connection until the acceptor is closed, like a server that goes down while accepting
+	 */
+	asio::awaitable<void> reset_connections(asio::ip::tcp::acceptor& acceptor_, std::atomic<u32>& resets_)
+	{
+		while (true)
+		{
+			asio::error_code ec;
+			auto socket = co_await acceptor_.async_accept(asio::redirect_error(asio::use_awaitable, ec));
+			if (ec)
+				co_return;
+			// Abortive close, the client reads a reset instead of the challenge
+			socket.set_option(asio::socket_base::linger{ true, 0 }, ec);
+			socket.close(ec);
+			++resets_;
+		}
+	}
+
+	pid_t spawn_server(char* path_)
+	{
+		pid_t pid{};
+		char* argv[] = { path_, nullptr };
+		if (posix_spawn(&pid, path_, nullptr, nullptr, argv, environ))
+			return 0;
+		return pid;
+	}
+}
+
+/**
+ * \brief restart the server while the client is connecting: the first listener resets the client before the challenge, then the real
+ * server comes up on the same port and the client should log in on its own
+ */
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		spdlog::error("Usage: reconnect_test <server executable>");
+		return 2;
+	}
+
+	asio::io_context context{ 1 };
+	asio::ip::tcp::acceptor acceptor{ context, asio::ip::tcp::endpoint{ asio::ip::tcp::v4(), SERVER_PORT } };
+	std::atomic<u32> resets{};
+	asio::co_spawn(context, reset_connections(acceptor, resets), asio::detached);
+	std::thread context_thread{ [&context] { context.run(); } };
+
+	ar::SimpleClient client{ asio::ip::address_v4::loopback(), SERVER_PORT };
+	// Set first, so the client is only waiting for the server
+	client.username("reconnect");
+	client.connect();
+
+	// Second reset means the client came back after the first one
+	const auto deadline = std::chrono::steady_clock::now() + 10s;
+	while (resets < 2 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(25ms);
+	asio::post(context, [&acceptor] { acceptor.close(); });
+	context_thread.join();
+
+	if (resets < 2)
+	{
+		spdlog::error("Client stopped connecting after {} resets", resets.load());
+		client.disconnect();
+		return 1;
+	}
+
+	const auto server = spawn_server(argv[1]);
+	if (!server)
+	{
+		spdlog::error("Failed to start {}", argv[1]);
+		client.disconnect();
+		return 1;
+	}
+
+	const auto connected = client.wait_for_state(ar::ClientState::Connected, 20s);
+	client.disconnect();
+	kill(server, SIGTERM);
+	waitpid(server, nullptr, 0);
+
+	if (!connected)
+	{
+		spdlog::error("Client didn't log in after the server came back, state {}", static_cast<int>(client.state()));
+		return 1;
+	}
+	spdlog::info("Client logged in after {} resets", resets.load());
+	return 0;
+}